@@ -1,56 +1,874 @@
 #include <benchmark/benchmark.h>
+#include "BPlusTree.hpp"
 #include "Btree.hpp"
+#include "BufferedBTree.hpp"
+#include "ConcurrentBTree.hpp"
+#include "MappedBTree.hpp"
+#include "ShardedBTree.hpp"
+#include <chrono>
+#include <cmath>
+#include <cstdlib>
+#include <filesystem>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <numeric>
+#include <optional>
+#include <random>
 #include <set>
+#include <span>
+#include <string>
+#include <thread>
 
+// bytes handed out by CountingAllocator, read by BM_MemoryTest
+static size_t counted_bytes = 0;
 
-static void custom_args(benchmark::internal::Benchmark* b) {
-    b->Args({1 << 11, 1 << 5, 1 << 10});
-    b->Args({1 << 15, 0, 1 << 11});
+// std::allocator that counts the bytes it hands out. Only BM_MemoryTest
+// builds containers with it, other benchmarks use the plain heap
+template <typename T>
+struct CountingAllocator {
+    using value_type = T;
+
+    CountingAllocator() = default;
+    template <typename U>
+    CountingAllocator(const CountingAllocator<U> &) {}
+
+    T *allocate(size_t count) {
+        counted_bytes += count * sizeof(T);
+        return std::allocator<T>().allocate(count);
+    }
+    void deallocate(T *memory, size_t count) { std::allocator<T>().deallocate(memory, count); }
+
+    friend bool operator==(const CountingAllocator &, const CountingAllocator &) { return true; }
+};
+
+template <size_t N, template <typename> typename Allocator = NodePool>
+static void BM_BTreeInsertTest(benchmark::State &state) {
+    for (auto _ : state) {
+        BTree<int64_t, N, Allocator> btree;
+        for (int64_t i = 0; i < state.range(0); ++i) {
+            btree.insert(i);
+        }
+        benchmark::DoNotOptimize(btree);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
 }
 
+// monotonic timestamps with a little reordering: every key is at most 64
+// positions away from its sorted place
+template <size_t N>
+static void BM_BTreeNearlySortedInsertTest(benchmark::State &state) {
+    std::vector<int64_t> keys(state.range(0));
+    std::iota(keys.begin(), keys.end(), 0);
+    std::mt19937_64 gen(42);
+    for (size_t i = 0; i + 1 < keys.size(); i += 64) {
+        std::shuffle(keys.begin() + i, keys.begin() + std::min(i + 64, keys.size()), gen);
+    }
+    for (auto _ : state) {
+        BTree<int64_t, N> btree;
+        for (int64_t key : keys) {
+            btree.insert(key);
+        }
+        benchmark::DoNotOptimize(btree);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
 
-static int range_query(benchmark::State &state, const std::set<int64_t> &set, int64_t begin, int64_t end) {
-    using it = std::set<int64_t>::iterator;
-    state.PauseTiming();
-    it start = set.lower_bound(begin);
-    it stop = set.upper_bound(end);
-    state.ResumeTiming();
-    return std::distance(start, stop);
+template <size_t N>
+static void BM_BTreeBulkLoadTest(benchmark::State &state) {
+    std::vector<int64_t> keys(state.range(0));
+    std::iota(keys.begin(), keys.end(), 0);
+    for (auto _ : state) {
+        BTree<int64_t, N> btree(keys.begin(), keys.end());
+        benchmark::DoNotOptimize(btree);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
 }
 
+static std::vector<int64_t> random_keys(size_t size, int64_t max) {
+    std::vector<int64_t> keys(size);
+    std::mt19937_64 gen(42);
+    for (int64_t &key : keys) {
+        key = gen() % max;
+    }
+    return keys;
+}
 
 template <size_t N>
-static void BM_BTreeDistanceTest(benchmark::State &state) {
+static void BM_BTreeInsertBatchTest(benchmark::State &state) {
+    auto keys = random_keys(state.range(0), 1 << 30);
     for (auto _ : state) {
-        state.PauseTiming();
         BTree<int64_t, N> btree;
-        for (int i = 0; i < state.range(0); ++i) {
-            btree.insert(i);
+        btree.insert_batch(keys);
+        benchmark::DoNotOptimize(btree);
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(0));
+}
+
+static std::vector<std::pair<int64_t, int64_t>> random_ranges(size_t size, int64_t max) {
+    auto bounds = random_keys(2 * size, max);
+    std::vector<std::pair<int64_t, int64_t>> ranges(size);
+    for (size_t i = 0; i < size; ++i) {
+        ranges[i] = std::minmax(bounds[2 * i], bounds[2 * i + 1]);
+    }
+    return ranges;
+}
+
+template <size_t N>
+static void BM_BTreeDistanceLoopTest(benchmark::State &state) {
+    std::vector<int64_t> keys(state.range(0));
+    std::iota(keys.begin(), keys.end(), 0);
+    BTree<int64_t, N> btree(keys.begin(), keys.end(), 0.75);
+    auto ranges = random_ranges(state.range(1), state.range(0));
+    std::vector<size_t> out(ranges.size());
+    for (auto _ : state) {
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            out[i] = btree.distance(ranges[i].first, ranges[i].second);
         }
-        state.ResumeTiming();
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(1));
+}
 
-        size_t btree_distance = btree.distance(state.range(1), state.range(2));
-        benchmark::DoNotOptimize(btree_distance);
+template <size_t N>
+static void BM_BTreeDistanceBatchTest(benchmark::State &state) {
+    std::vector<int64_t> keys(state.range(0));
+    std::iota(keys.begin(), keys.end(), 0);
+    BTree<int64_t, N> btree(keys.begin(), keys.end(), 0.75);
+    auto ranges = random_ranges(state.range(1), state.range(0));
+    std::vector<size_t> out(ranges.size());
+    for (auto _ : state) {
+        btree.distance_batch(ranges, out);
+        benchmark::DoNotOptimize(out.data());
     }
+    state.SetItemsProcessed(state.iterations() * state.range(1));
 }
 
-static void BM_SetDistanceTest(benchmark::State &state) {
+template <size_t N>
+static void BM_BTreeDistanceManyTest(benchmark::State &state) {
+    std::vector<int64_t> keys(state.range(0));
+    std::iota(keys.begin(), keys.end(), 0);
+    BTree<int64_t, N> btree(keys.begin(), keys.end(), 0.75);
+    auto ranges = random_ranges(state.range(1), state.range(0));
+    std::vector<size_t> out(ranges.size());
     for (auto _ : state) {
-        state.PauseTiming();
-        std::set<int64_t> set;
-        for (int64_t i = 0; i < state.range(0); ++i) {
-            set.insert(i);
+        btree.distance_many(ranges, out);
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(1));
+}
+
+// distances over 8 equal shards one by one or with distance_many, the tree
+// keeps a pool of range(2) threads
+template <bool Many>
+static void BM_ShardedDistanceTest(benchmark::State &state) {
+    const int64_t shards = 8;
+    std::vector<int64_t> bounds;
+    for (int64_t i = 1; i < shards; ++i) {
+        bounds.push_back(i * state.range(0) / shards);
+    }
+    ShardedBTree<int64_t, 8> tree(bounds, state.range(2));
+    for (int64_t key = 0; key < state.range(0); ++key) {
+        tree.insert(key);
+    }
+    auto ranges = random_ranges(state.range(1), state.range(0));
+    std::vector<size_t> out(ranges.size());
+    for (auto _ : state) {
+        if constexpr (Many) {
+            tree.distance_many(ranges, out);
+        } else {
+            for (size_t i = 0; i < ranges.size(); ++i) {
+                out[i] = tree.distance(ranges[i].first, ranges[i].second);
+            }
         }
-        state.ResumeTiming();
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(1));
+}
 
-        size_t set_distance = range_query(state, set, state.range(1), state.range(2));
-        benchmark::DoNotOptimize(set_distance);
+// finds of random keys one by one or interleaved with find_many
+template <size_t N, bool Many>
+static void BM_BTreeFindManyTest(benchmark::State &state) {
+    std::vector<int64_t> keys(state.range(0));
+    std::iota(keys.begin(), keys.end(), 0);
+    BTree<int64_t, N> btree(keys.begin(), keys.end(), 0.75);
+    auto lookups = random_keys(state.range(1), state.range(0));
+    std::vector<typename BTree<int64_t, N>::const_iterator> out(lookups.size());
+    for (auto _ : state) {
+        if constexpr (Many) {
+            btree.find_many(lookups, out);
+        } else {
+            for (size_t i = 0; i < lookups.size(); ++i) {
+                out[i] = btree.find(lookups[i]);
+            }
+        }
+        benchmark::DoNotOptimize(out.data());
+    }
+    state.SetItemsProcessed(state.iterations() * state.range(1));
+}
+
+// intra-node search over a full node of 2N - 1 keys
+template <typename Key, size_t N, typename Search>
+static void BM_NodeSearchTest(benchmark::State &state) {
+    const size_t size = 2 * N - 1;
+    std::array<Key, NodeSearch<Key>::capacity(size)> keys{};
+    for (size_t i = 0; i < size; ++i) {
+        keys[i] = static_cast<Key>(2 * i);
+    }
+    std::vector<Key> queries(1024);
+    std::mt19937 gen(42);
+    for (Key &query : queries) {
+        query = static_cast<Key>(gen() % (4 * N));
+    }
+    size_t i = 0;
+    for (auto _ : state) {
+        size_t index = Search::lower_index(keys.data(), size, queries[i++ % queries.size()]);
+        benchmark::DoNotOptimize(index);
+    }
+}
+
+BENCHMARK_TEMPLATE(BM_NodeSearchTest, int32_t, 8, BinarySearch<int32_t>);
+BENCHMARK_TEMPLATE(BM_NodeSearchTest, int32_t, 8, NodeSearch<int32_t>);
+BENCHMARK_TEMPLATE(BM_NodeSearchTest, int32_t, 32, BinarySearch<int32_t>);
+BENCHMARK_TEMPLATE(BM_NodeSearchTest, int32_t, 32, NodeSearch<int32_t>);
+BENCHMARK_TEMPLATE(BM_NodeSearchTest, int64_t, 8, BinarySearch<int64_t>);
+BENCHMARK_TEMPLATE(BM_NodeSearchTest, int64_t, 8, NodeSearch<int64_t>);
+BENCHMARK_TEMPLATE(BM_NodeSearchTest, int64_t, 32, BinarySearch<int64_t>);
+BENCHMARK_TEMPLATE(BM_NodeSearchTest, int64_t, 32, NodeSearch<int64_t>);
+BENCHMARK_TEMPLATE(BM_NodeSearchTest, double, 16, BinarySearch<double>);
+BENCHMARK_TEMPLATE(BM_NodeSearchTest, double, 16, NodeSearch<double>);
+
+BENCHMARK(BM_BTreeInsertTest<6>)->Arg(1 << 15);
+BENCHMARK(BM_BTreeInsertTest<8>)->Arg(1 << 15)->Arg(1 << 20);
+BENCHMARK(BM_BTreeInsertTest<10>)->Arg(1 << 15);
+BENCHMARK_TEMPLATE(BM_BTreeInsertTest, 8, HeapAllocator)->Arg(1 << 15);
+BENCHMARK(BM_BTreeNearlySortedInsertTest<8>)->Arg(1 << 15)->Arg(1 << 20);
+BENCHMARK(BM_BTreeBulkLoadTest<8>)->Arg(1 << 15)->Arg(1 << 20);
+BENCHMARK(BM_BTreeInsertBatchTest<8>)->Arg(1 << 15)->Arg(1 << 20);
+BENCHMARK(BM_BTreeDistanceLoopTest<8>)->Args({1 << 22, 1 << 16});
+BENCHMARK(BM_BTreeDistanceBatchTest<8>)->Args({1 << 22, 1 << 16});
+BENCHMARK(BM_BTreeDistanceManyTest<8>)->Args({1 << 22, 1 << 16});
+BENCHMARK(BM_ShardedDistanceTest<false>)
+    ->Args({1 << 22, 1 << 16, 1})
+    ->Args({1 << 22, 1 << 16, 4})
+    ->UseRealTime();
+BENCHMARK(BM_ShardedDistanceTest<true>)
+    ->Args({1 << 22, 1 << 16, 1})
+    ->Args({1 << 22, 1 << 16, 4})
+    ->UseRealTime();
+BENCHMARK(BM_BTreeFindManyTest<8, false>)->Args({1 << 22, 1 << 16});
+BENCHMARK(BM_BTreeFindManyTest<8, true>)->Args({1 << 22, 1 << 16});
+
+// full in-order scan, Container is filled with state.range(0) random keys
+template <typename Container>
+static void BM_ScanTest(benchmark::State &state) {
+    Container container;
+    for (int64_t key : random_keys(state.range(0), 1 << 30)) {
+        container.insert(key);
+    }
+    for (auto _ : state) {
+        int64_t sum = 0;
+        for (int64_t key : container) {
+            sum += key;
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * container.size());
+}
+
+template <typename Container>
+static void BM_ReverseScanTest(benchmark::State &state) {
+    Container container;
+    for (int64_t key : random_keys(state.range(0), 1 << 30)) {
+        container.insert(key);
+    }
+    for (auto _ : state) {
+        int64_t sum = 0;
+        for (auto it = container.end(); it != container.begin();) {
+            sum += *--it;
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+    state.SetItemsProcessed(state.iterations() * container.size());
+}
+
+// lower_bound at a random key, then a short forward scan
+template <typename Container>
+static void BM_SeekScanTest(benchmark::State &state) {
+    Container container;
+    for (int64_t key : random_keys(state.range(0), 1 << 30)) {
+        container.insert(key);
+    }
+    auto seeks = random_keys(1024, 1 << 30);
+    size_t i = 0;
+    for (auto _ : state) {
+        int64_t sum = 0;
+        auto it = container.lower_bound(seeks[i++ % seeks.size()]);
+        for (int step = 0; step < 16 && it != container.end(); ++step, ++it) {
+            sum += *it;
+        }
+        benchmark::DoNotOptimize(sum);
+    }
+}
+
+BENCHMARK_TEMPLATE(BM_ReverseScanTest, std::set<int64_t>)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_ReverseScanTest, BTree<int64_t, 8>)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_ReverseScanTest, BPlusTree<int64_t, 8>)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_SeekScanTest, std::set<int64_t>)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_SeekScanTest, BTree<int64_t, 8>)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_SeekScanTest, BPlusTree<int64_t, 8>)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_ScanTest, std::set<int64_t>)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_ScanTest, BTree<int64_t, 8>)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_ScanTest, BPlusTree<int64_t, 8>)->Arg(1 << 20);
+
+// startup from a saved image: map the file and answer one range count
+static void BM_MappedOpenTest(benchmark::State &state) {
+    auto path = std::filesystem::temp_directory_path() / "bench_tree_image";
+    BTree<int64_t, 8> btree;
+    for (int64_t i = 0; i < state.range(0); ++i) {
+        btree.insert(i);
+    }
+    btree.save(path);
+    for (auto _ : state) {
+        MappedBTree<int64_t, 8> mapped(path);
+        benchmark::DoNotOptimize(mapped.distance(0, state.range(0) / 2));
+    }
+    std::filesystem::remove(path);
+}
+
+BENCHMARK(BM_MappedOpenTest)->Arg(1 << 20);
+
+// cache line sized payload, a map that keeps it next to keys reads it on
+// every visited node
+struct Payload {
+    std::array<int64_t, 8> data{};
+};
+
+template <typename Map>
+static void BM_MapFindTest(benchmark::State &state) {
+    Map map;
+    for (int64_t key : random_keys(state.range(0), 2 * state.range(0))) {
+        map[key].data[0] = key;
+    }
+    auto keys = random_keys(1 << 16, 2 * state.range(0));
+    size_t i = 0;
+    int64_t sum = 0;
+    for (auto _ : state) {
+        auto it = map.find(keys[i++ & (keys.size() - 1)]);
+        if (it != map.end()) {
+            sum += it->second.data[0];
+        }
+    }
+    benchmark::DoNotOptimize(sum);
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK_TEMPLATE(BM_MapFindTest, std::map<int64_t, Payload>)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_MapFindTest, BTreeMap<int64_t, Payload, 16>)->Arg(1 << 20);
+
+using SumTree = BTree<int64_t, 8, NodePool, std::less<int64_t>, void, SumAggregate<int64_t>>;
+
+// sum of keys in random ranges of range(1) keys, by aggregate or by a scan
+template <bool Aggregated>
+static void BM_RangeSumTest(benchmark::State &state) {
+    SumTree tree;
+    for (int64_t key : random_keys(state.range(0), 2 * state.range(0))) {
+        tree.insert(key);
+    }
+    auto begins = random_keys(1 << 16, 2 * state.range(0));
+    size_t i = 0;
+    for (auto _ : state) {
+        int64_t begin = begins[i++ & (begins.size() - 1)];
+        int64_t end = begin + 2 * state.range(1);
+        if constexpr (Aggregated) {
+            benchmark::DoNotOptimize(tree.aggregate(begin, end));
+        } else {
+            int64_t sum = 0;
+            for (auto it = tree.lower_bound(begin); it != tree.end() && *it <= end; ++it) {
+                sum += *it;
+            }
+            benchmark::DoNotOptimize(sum);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+BENCHMARK(BM_RangeSumTest<false>)->Args({1 << 20, 1000});
+BENCHMARK(BM_RangeSumTest<true>)->Args({1 << 20, 1000});
+
+// distance and find of random keys through the nodes of a tree or through
+// its frozen copy
+template <bool Frozen>
+static void BM_FrozenDistanceTest(benchmark::State &state) {
+    std::vector<int64_t> keys(state.range(0));
+    std::iota(keys.begin(), keys.end(), 0);
+    BTree<int64_t, 8> btree(keys.begin(), keys.end(), 0.75);
+    auto frozen = btree.freeze();
+    auto ranges = random_ranges(1 << 16, state.range(0));
+    size_t i = 0;
+    for (auto _ : state) {
+        auto [begin, end] = ranges[i++ & (ranges.size() - 1)];
+        if constexpr (Frozen) {
+            benchmark::DoNotOptimize(frozen.distance(begin, end));
+        } else {
+            benchmark::DoNotOptimize(btree.distance(begin, end));
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FrozenDistanceTest<false>)->Arg(1 << 16)->Arg(1 << 22);
+BENCHMARK(BM_FrozenDistanceTest<true>)->Arg(1 << 16)->Arg(1 << 22);
+
+template <bool Frozen>
+static void BM_FrozenFindTest(benchmark::State &state) {
+    std::vector<int64_t> keys(state.range(0));
+    std::iota(keys.begin(), keys.end(), 0);
+    BTree<int64_t, 8> btree(keys.begin(), keys.end(), 0.75);
+    auto frozen = btree.freeze();
+    auto lookups = random_keys(1 << 16, state.range(0));
+    size_t i = 0;
+    for (auto _ : state) {
+        int64_t key = lookups[i++ & (lookups.size() - 1)];
+        if constexpr (Frozen) {
+            benchmark::DoNotOptimize(frozen.find(key));
+        } else {
+            benchmark::DoNotOptimize(btree.find(key));
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+BENCHMARK(BM_FrozenFindTest<false>)->Arg(1 << 16)->Arg(1 << 22);
+BENCHMARK(BM_FrozenFindTest<true>)->Arg(1 << 16)->Arg(1 << 22);
+
+// BTree behind one mutex, the baseline ConcurrentBTree has to beat
+struct LockedBTree {
+    std::mutex mutex;
+    BTree<int64_t, 8> tree;
+
+    bool insert(int64_t key) {
+        std::lock_guard lock(mutex);
+        return tree.insert(key);
+    }
+    bool erase(int64_t key) {
+        std::lock_guard lock(mutex);
+        return tree.erase(key);
+    }
+    bool contains(int64_t key) {
+        std::lock_guard lock(mutex);
+        return tree.find(key) != tree.end();
+    }
+    size_t distance(int64_t begin, int64_t end) {
+        std::lock_guard lock(mutex);
+        return tree.distance(begin, end);
+    }
+};
+
+// one tree shared by all threads: 10% inserts, 10% erases, 70% lookups and
+// 10% short range counts over keys in [0, range(0))
+template <typename Tree>
+static void BM_SharedMixedTest(benchmark::State &state) {
+    static Tree *tree = nullptr;
+    if (state.thread_index() == 0) {
+        tree = new Tree;
+        for (int64_t i = 0; i < state.range(0); i += 2) {
+            tree->insert(i);
+        }
+    }
+    std::mt19937_64 rng(state.thread_index());
+    for (auto _ : state) {
+        uint64_t random = rng();
+        int64_t key = random % state.range(0);
+        switch (random >> 60) {
+        case 0:
+            benchmark::DoNotOptimize(tree->insert(key));
+            break;
+        case 1:
+            benchmark::DoNotOptimize(tree->erase(key));
+            break;
+        case 2:
+            benchmark::DoNotOptimize(tree->distance(key, key + 100));
+            break;
+        default:
+            benchmark::DoNotOptimize(tree->contains(key));
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+    if (state.thread_index() == 0) {
+        delete tree;
+    }
+}
+
+static const int max_threads = std::max(1u, std::thread::hardware_concurrency());
+
+BENCHMARK_TEMPLATE(BM_SharedMixedTest, LockedBTree)
+    ->Arg(1 << 20)
+    ->ThreadRange(1, max_threads)
+    ->UseRealTime();
+BENCHMARK_TEMPLATE(BM_SharedMixedTest, ConcurrentBTree<int64_t, 8>)
+    ->Arg(1 << 20)
+    ->ThreadRange(1, max_threads)
+    ->UseRealTime();
+
+// Workload suite. Every operation runs for std::set and BTree of several
+// degrees on the same key streams. A container of size n holds the even keys
+// 0, 2, ..., 2n - 2, built in random order; operations draw keys from it:
+//   uniform - independent uniform picks
+//   zipf    - Zipf(0.99) ranks scattered over the keys, few keys are hot
+//   sorted  - ascending sweep, reverse - descending sweep
+// Containers are built once outside the timed loop and modifying benchmarks
+// restore them; per-iteration builds are timed manually, not by PauseTiming.
+// Sizes run from 1K up to BTREE_BENCH_MAX_SIZE keys (1M by default, 100M
+// covers the full range).
+
+enum class Keys { uniform, zipf, sorted, reverse };
+
+// Zipf ranks in [0, items) as generated by YCSB (Gray et al.)
+class ZipfGenerator {
+  private:
+    static constexpr double theta = 0.99;
+
+    uint64_t m_items;
+    double m_zeta;
+    double m_alpha;
+    double m_eta;
+
+    // sum of i^-theta for i in [1, n], the tail past 2^20 is integrated
+    static double zeta(uint64_t n) {
+        uint64_t exact = std::min<uint64_t>(n, 1 << 20);
+        double sum = 0;
+        for (uint64_t i = 1; i <= exact; ++i) {
+            sum += std::pow(static_cast<double>(i), -theta);
+        }
+        if (n > exact) {
+            sum += (std::pow(n, 1 - theta) - std::pow(exact, 1 - theta)) / (1 - theta);
+        }
+        return sum;
+    }
+
+  public:
+    explicit ZipfGenerator(uint64_t items)
+        : m_items(items), m_zeta(zeta(items)), m_alpha(1 / (1 - theta)),
+          m_eta((1 - std::pow(2.0 / items, 1 - theta)) / (1 - zeta(2) / m_zeta)) {}
+
+    uint64_t operator()(std::mt19937_64 &gen) {
+        double u = std::uniform_real_distribution<double>(0, 1)(gen);
+        double uz = u * m_zeta;
+        if (uz < 1) {
+            return 0;
+        }
+        if (uz < 1 + std::pow(0.5, theta)) {
+            return 1;
+        }
+        auto rank = static_cast<uint64_t>(m_items * std::pow(m_eta * u - m_eta + 1, m_alpha));
+        return std::min(rank, m_items - 1);
+    }
+};
+
+static const char *keys_name(Keys keys) {
+    constexpr const char *names[] = {"uniform", "zipf", "sorted", "reverse"};
+    return names[static_cast<int>(keys)];
+}
+
+// count keys of a container of given size, picked as described above
+static std::vector<int64_t> make_keys(Keys kind, size_t count, size_t size, uint64_t seed = 42) {
+    std::vector<int64_t> keys(count);
+    std::mt19937_64 gen(seed);
+    std::optional<ZipfGenerator> zipf;
+    if (kind == Keys::zipf) {
+        zipf.emplace(size);
+    }
+    for (size_t i = 0; i < count; ++i) {
+        uint64_t index = 0;
+        switch (kind) {
+        case Keys::uniform:
+            index = gen() % size;
+            break;
+        case Keys::zipf:
+            // scatter hot ranks over the key range
+            index = (*zipf)(gen) * 0x9e3779b97f4a7c15 % size;
+            break;
+        case Keys::sorted:
+            index = i % size;
+            break;
+        case Keys::reverse:
+            index = size - 1 - i % size;
+            break;
+        }
+        keys[i] = 2 * static_cast<int64_t>(index);
+    }
+    return keys;
+}
+
+// every key of a container of given size in random order
+static std::vector<int64_t> shuffled_keys(size_t size) {
+    std::vector<int64_t> keys(size);
+    for (size_t i = 0; i < size; ++i) {
+        keys[i] = 2 * static_cast<int64_t>(i);
+    }
+    std::shuffle(keys.begin(), keys.end(), std::mt19937_64(42));
+    return keys;
+}
+
+template <typename Container>
+static Container make_container(size_t size) {
+    Container container;
+    for (int64_t key : shuffled_keys(size)) {
+        container.insert(key);
+    }
+    return container;
+}
+
+template <typename Container>
+static size_t range_count(const Container &container, int64_t begin, int64_t end) {
+    if constexpr (requires { container.distance(begin, end); }) {
+        return container.distance(begin, end);
+    } else {
+        return std::distance(container.lower_bound(begin), container.upper_bound(end));
+    }
+}
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+    return std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+}
+
+// builds a container of range(0) keys inserted in stream order; uniform
+// inserts every key once, zipf streams repeat hot keys
+template <typename Container>
+static void BM_InsertTest(benchmark::State &state, Keys kind) {
+    size_t size = state.range(0);
+    auto keys = kind == Keys::uniform ? shuffled_keys(size) : make_keys(kind, size, size);
+    for (auto _ : state) {
+        Container container;
+        auto start = std::chrono::steady_clock::now();
+        for (int64_t key : keys) {
+            container.insert(key);
+        }
+        state.SetIterationTime(seconds_since(start));
+        benchmark::DoNotOptimize(container);
+    }
+    state.SetItemsProcessed(state.iterations() * size);
+}
+
+// erases a batch of keys, reinserting them afterwards is not timed
+template <typename Container>
+static void BM_EraseTest(benchmark::State &state, Keys kind) {
+    const size_t batch = 1024;
+    size_t size = state.range(0);
+    auto container = make_container<Container>(size);
+    auto keys = make_keys(kind, std::max(batch, size), size);
+    size_t offset = 0;
+    for (auto _ : state) {
+        std::span<const int64_t> erased(keys.data() + offset, batch);
+        offset = (offset + batch) % (keys.size() - batch + 1);
+        auto start = std::chrono::steady_clock::now();
+        for (int64_t key : erased) {
+            container.erase(key);
+        }
+        state.SetIterationTime(seconds_since(start));
+        for (int64_t key : erased) {
+            container.insert(key);
+        }
+    }
+    state.SetItemsProcessed(state.iterations() * batch);
+}
+
+template <typename Container>
+static void BM_FindTest(benchmark::State &state, Keys kind) {
+    size_t size = state.range(0);
+    auto container = make_container<Container>(size);
+    auto keys = make_keys(kind, 1 << 16, size);
+    size_t i = 0;
+    for (auto _ : state) {
+        benchmark::DoNotOptimize(container.find(keys[i++ & (keys.size() - 1)]));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// number of keys in ranges that start at a picked key and span 1000 keys
+template <typename Container>
+static void BM_RangeCountTest(benchmark::State &state, Keys kind) {
+    size_t size = state.range(0);
+    auto container = make_container<Container>(size);
+    auto keys = make_keys(kind, 1 << 16, size);
+    size_t i = 0;
+    for (auto _ : state) {
+        int64_t begin = keys[i++ & (keys.size() - 1)];
+        benchmark::DoNotOptimize(range_count(container, begin, begin + 2000));
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// range(1) percent of operations are lookups, the rest toggle a key: erase
+// it when present, insert it back otherwise, so the size stays near range(0)
+template <typename Container>
+static void BM_MixedTest(benchmark::State &state, Keys kind) {
+    size_t size = state.range(0);
+    auto container = make_container<Container>(size);
+    auto keys = make_keys(kind, 1 << 16, size);
+    std::mt19937_64 gen(7);
+    std::vector<bool> reads(1 << 16);
+    for (size_t j = 0; j < reads.size(); ++j) {
+        reads[j] = static_cast<int64_t>(gen() % 100) < state.range(1);
+    }
+    size_t i = 0;
+    for (auto _ : state) {
+        size_t j = i++ & (keys.size() - 1);
+        if (reads[j]) {
+            benchmark::DoNotOptimize(container.find(keys[j]));
+        } else if (!container.erase(keys[j])) {
+            container.insert(keys[j]);
+        }
+    }
+    state.SetItemsProcessed(state.iterations());
+}
+
+// container as BM_MemoryTest builds it: std containers count their heap
+// bytes with CountingAllocator, trees report their nodes in stats()
+template <typename Container>
+struct Counted {
+    using type = Container;
+};
+template <typename Key>
+struct Counted<std::set<Key>> {
+    using type = std::set<Key, std::less<Key>, CountingAllocator<Key>>;
+};
+
+// heap bytes per key of a container built from shuffled keys
+template <typename Container>
+static void BM_MemoryTest(benchmark::State &state) {
+    size_t size = state.range(0);
+    auto keys = shuffled_keys(size);
+    size_t bytes = 0;
+    for (auto _ : state) {
+        size_t before = counted_bytes;
+        typename Counted<Container>::type container;
+        for (int64_t key : keys) {
+            container.insert(key);
+        }
+        if constexpr (requires { container.stats(); }) {
+            bytes = container.stats().node_bytes;
+        } else {
+            bytes = counted_bytes - before;
+        }
+        benchmark::DoNotOptimize(container);
+    }
+    state.counters["bytes_per_key"] = static_cast<double>(bytes) / size;
+}
+
+static std::vector<int64_t> suite_sizes() {
+    int64_t max_size = 1000000;
+    if (const char *env = std::getenv("BTREE_BENCH_MAX_SIZE")) {
+        max_size = std::atoll(env);
+    }
+    std::vector<int64_t> sizes;
+    for (int64_t size : {1000, 32000, 1000000, 32000000, 100000000}) {
+        if (size <= max_size) {
+            sizes.push_back(size);
+        }
+    }
+    return sizes;
+}
+
+template <typename Container>
+static void register_suite(const std::string &name) {
+    auto sizes = suite_sizes();
+    auto apply_sizes = [&](benchmark::internal::Benchmark *bench) {
+        for (int64_t size : sizes) {
+            bench->Arg(size);
+        }
+        return bench;
+    };
+    using Test = void (*)(benchmark::State &, Keys);
+    std::pair<const char *, Test> tests[] = {{"BM_InsertTest", BM_InsertTest<Container>},
+                                             {"BM_EraseTest", BM_EraseTest<Container>},
+                                             {"BM_FindTest", BM_FindTest<Container>},
+                                             {"BM_RangeCountTest", BM_RangeCountTest<Container>}};
+    for (Keys kind : {Keys::uniform, Keys::zipf, Keys::sorted, Keys::reverse}) {
+        for (auto [test_name, test] : tests) {
+            std::string full_name = std::string(test_name) + "<" + name + ">/" + keys_name(kind);
+            auto *bench = benchmark::RegisterBenchmark(full_name.c_str(), test, kind);
+            apply_sizes(bench);
+            if (test == tests[0].second || test == tests[1].second) {
+                bench->UseManualTime();
+            }
+        }
+        std::string mixed_name = "BM_MixedTest<" + name + ">/" + keys_name(kind);
+        auto *mixed =
+            benchmark::RegisterBenchmark(mixed_name.c_str(), BM_MixedTest<Container>, kind);
+        for (int64_t size : sizes) {
+            for (int64_t reads : {50, 90, 99}) {
+                mixed->Args({size, reads});
+            }
+        }
+    }
+    apply_sizes(benchmark::RegisterBenchmark(("BM_ScanTest<" + name + ">").c_str(),
+                                             BM_ScanTest<Container>));
+    apply_sizes(benchmark::RegisterBenchmark(("BM_MemoryTest<" + name + ">").c_str(),
+                                             BM_MemoryTest<Container>))
+        ->Iterations(1);
+}
+
+// retention: the oldest range(1) keys of a tree of range(0) keys are erased
+// by erase_range or key by key, reinserting them afterwards is not timed
+template <bool Bulk>
+static void BM_EraseRangeTest(benchmark::State &state) {
+    size_t size = state.range(0);
+    int64_t window = state.range(1);
+    auto tree = make_container<BTree<int64_t, 8>>(size);
+    std::vector<int64_t> erased(window);
+    int64_t begin = 0;
+    for (auto _ : state) {
+        for (int64_t i = 0; i < window; ++i) {
+            erased[i] = begin + 2 * i;
+        }
+        auto start = std::chrono::steady_clock::now();
+        if constexpr (Bulk) {
+            tree.erase_range(erased.front(), erased.back());
+        } else {
+            for (int64_t key : erased) {
+                tree.erase(key);
+            }
+        }
+        state.SetIterationTime(seconds_since(start));
+        tree.insert_batch(erased);
+        begin = (begin + 2 * window) % (2 * static_cast<int64_t>(size - window));
+    }
+    state.SetItemsProcessed(state.iterations() * window);
+}
+BENCHMARK(BM_EraseRangeTest<false>)->Args({1 << 20, 1 << 14})->UseManualTime();
+BENCHMARK(BM_EraseRangeTest<true>)->Args({1 << 20, 1 << 14})->UseManualTime();
+
+// random inserts followed by erases of every other key; buffered trees
+// apply the last pending messages before the clock stops
+template <typename Container>
+static void BM_WriteTest(benchmark::State &state) {
+    auto keys = shuffled_keys(state.range(0));
+    for (auto _ : state) {
+        Container container;
+        for (int64_t key : keys) {
+            container.insert(key);
+        }
+        for (size_t i = 0; i < keys.size(); i += 2) {
+            container.erase(keys[i]);
+        }
+        if constexpr (requires { container.flush(); }) {
+            container.flush();
+        }
+        benchmark::DoNotOptimize(container);
     }
+    state.SetItemsProcessed(state.iterations() * (state.range(0) + (state.range(0) + 1) / 2));
 }
+BENCHMARK_TEMPLATE(BM_WriteTest, BTree<int64_t, 8>)->Arg(1 << 16)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_WriteTest, BufferedBTree<int64_t, 8>)->Arg(1 << 16)->Arg(1 << 20);
+BENCHMARK_TEMPLATE(BM_WriteTest, BufferedBTree<int64_t, 32>)->Arg(1 << 16)->Arg(1 << 20);
 
-BENCHMARK(BM_SetDistanceTest)->Apply(custom_args);
-BENCHMARK(BM_BTreeDistanceTest<6>)->Apply(custom_args);
-BENCHMARK(BM_BTreeDistanceTest<8>)->Apply(custom_args);
-BENCHMARK(BM_BTreeDistanceTest<10>)->Apply(custom_args);
+static const bool suite_registered = [] {
+    register_suite<std::set<int64_t>>("std::set");
+    register_suite<BTree<int64_t, 4>>("BTree<4>");
+    register_suite<BTree<int64_t, 8>>("BTree<8>");
+    register_suite<BTree<int64_t, 16>>("BTree<16>");
+    register_suite<BTree<int64_t, 32>>("BTree<32>");
+    return true;
+}();
 
 BENCHMARK_MAIN();
@@ -0,0 +1,71 @@
+#pragma once
+
+#include <cstddef>
+#include <limits>
+#include <type_traits>
+#include <utility>
+
+// Subtree aggregates for BTree::aggregate. A policy is a monoid over the
+// items of a tree: type, identity(), lift(item) and an associative
+// combine(lhs, rhs), applied in key order. Items are keys of sets and
+// std::pair<const Key &, const Value &> of maps. Policies are default
+// constructed like comparators, so they can't carry state.
+
+// number of keys; BTree keeps it in its order-statistics counters anyway, so
+// this default costs nothing extra
+struct CountAggregate {
+    using type = size_t;
+
+    static type identity() { return 0; }
+    template <typename Item>
+    static type lift(const Item &) {
+        return 1;
+    }
+    static type combine(type lhs, type rhs) { return lhs + rhs; }
+};
+
+// the aggregated part of an item: the value of a map entry, the key otherwise
+template <typename Item>
+decltype(auto) aggregated_value(const Item &item) {
+    if constexpr (requires { item.second; }) {
+        return (item.second);
+    } else {
+        return (item);
+    }
+}
+
+template <typename T>
+struct SumAggregate {
+    using type = T;
+
+    static type identity() { return T{}; }
+    template <typename Item>
+    static type lift(const Item &item) {
+        return static_cast<T>(aggregated_value(item));
+    }
+    static type combine(const type &lhs, const type &rhs) { return lhs + rhs; }
+};
+
+template <typename T>
+struct MinAggregate {
+    using type = T;
+
+    static type identity() { return std::numeric_limits<T>::max(); }
+    template <typename Item>
+    static type lift(const Item &item) {
+        return static_cast<T>(aggregated_value(item));
+    }
+    static type combine(const type &lhs, const type &rhs) { return rhs < lhs ? rhs : lhs; }
+};
+
+template <typename T>
+struct MaxAggregate {
+    using type = T;
+
+    static type identity() { return std::numeric_limits<T>::lowest(); }
+    template <typename Item>
+    static type lift(const Item &item) {
+        return static_cast<T>(aggregated_value(item));
+    }
+    static type combine(const type &lhs, const type &rhs) { return lhs < rhs ? rhs : lhs; }
+};
@@ -0,0 +1,580 @@
+#pragma once
+
+#include "NodePool.hpp"
+#include "NodeSearch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iostream>
+#include <iterator>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template <typename Key, size_t N, template <typename> typename Allocator>
+class BPlusTree;
+
+template <typename NodeT>
+class BPlusIterator;
+
+// B+tree node: leaves hold every key and are chained in key order, internal
+// nodes hold separators only. Son i of an internal node holds keys k with
+// keys[i - 1] <= k < keys[i].
+template <typename Key, size_t N>
+struct alignas(64) BPlusNode final {
+  private:
+    static_assert(N >= 2, "BPlusTree degree must be at least 2");
+
+    static constexpr size_t max_keys = 2 * N - 1;
+    static constexpr size_t max_sons = 2 * N;
+
+    using keys_t = std::array<Key, NodeSearch<Key>::capacity(max_keys)>;
+    using sons_t = std::array<BPlusNode *, max_sons>;
+    using prefix_t = std::array<size_t, max_sons>;
+
+    template <typename, size_t, template <typename> typename>
+    friend class BPlusTree;
+    friend BPlusIterator<BPlusNode>;
+
+    keys_t m_keys;
+    sons_t m_sons;
+    prefix_t m_prefix; // internal nodes: number of keys in sons[0..i]
+    BPlusNode *m_prev = nullptr; // leaves only
+    BPlusNode *m_next = nullptr;
+    size_t m_counter = 0; // sizeof subtree
+    uint32_t m_size = 0;  // number of keys in node
+    bool m_leaf = true;
+
+  public:
+    using value_type = Key;
+
+    explicit BPlusNode(bool leaf) : m_leaf(leaf) {}
+    BPlusNode(const BPlusNode &) = delete;
+    BPlusNode(BPlusNode &&) = delete;
+
+    BPlusNode &operator=(const BPlusNode &rhs) = delete;
+    BPlusNode &operator=(BPlusNode &&rhs) = delete;
+
+    ~BPlusNode() = default;
+
+    template <typename Alloc>
+    static BPlusNode *create(Alloc &alloc, bool leaf) {
+        return ::new (static_cast<void *>(alloc.allocate())) BPlusNode(leaf);
+    }
+
+    template <typename Alloc>
+    static void destroy(Alloc &alloc, BPlusNode *node) {
+        node->~BPlusNode();
+        alloc.deallocate(node);
+    }
+
+    template <typename Alloc>
+    static void destroy_subtree(Alloc &alloc, BPlusNode *node) {
+        for (BPlusNode *son : node->sons()) {
+            destroy_subtree(alloc, son);
+        }
+        destroy(alloc, node);
+    }
+
+    size_t size() const { return m_size; }
+    size_t sons_count() const { return m_leaf ? 0 : m_size + 1; }
+    size_t count() const { return m_counter; }
+    bool is_leaf() const { return m_leaf; }
+    bool is_full() const { return m_size == max_keys; }
+
+    std::span<const Key> keys() const { return {m_keys.data(), m_size}; }
+    std::span<BPlusNode *const> sons() const { return {m_sons.data(), sons_count()}; }
+
+    size_t lower_index(const Key &key) const {
+        return NodeSearch<Key>::lower_index(m_keys.data(), m_size, key);
+    }
+    size_t upper_index(const Key &key) const {
+        return NodeSearch<Key>::upper_index(m_keys.data(), m_size, key);
+    }
+
+    // number of keys in subtree less than key, or not greater than key if upper
+    size_t rank(const Key &key, bool upper = false) const {
+        size_t counter = 0;
+        const BPlusNode *node = this;
+        while (!node->m_leaf) {
+            size_t index = node->upper_index(key);
+            counter += index == 0 ? 0 : node->m_prefix[index - 1];
+            node = node->m_sons[index];
+        }
+        return counter + (upper ? node->upper_index(key) : node->lower_index(key));
+    }
+
+    // leaf and position of first key not less than key, or not greater if upper
+    std::pair<const BPlusNode *, size_t> leaf_bound(const Key &key, bool upper) const {
+        const BPlusNode *node = this;
+        while (!node->m_leaf) {
+            node = node->m_sons[node->upper_index(key)];
+        }
+        size_t index = upper ? node->upper_index(key) : node->lower_index(key);
+        if (index == node->m_size && node->m_next) {
+            return {node->m_next, 0};
+        }
+        return {node, index};
+    }
+
+    // position of the key with given rank in subtree, rank < count()
+    std::pair<const BPlusNode *, size_t> select(size_t rank) const {
+        const BPlusNode *node = this;
+        while (!node->m_leaf) {
+            size_t index = std::upper_bound(node->m_prefix.begin(),
+                                            node->m_prefix.begin() + node->m_size + 1, rank) -
+                           node->m_prefix.begin();
+            rank -= index == 0 ? 0 : node->m_prefix[index - 1];
+            node = node->m_sons[index];
+        }
+        return {node, rank};
+    }
+
+    template <typename Alloc>
+    bool insert(const Key &key, Alloc &alloc, BPlusNode *&tail) {
+        if (m_leaf) {
+            size_t index = lower_index(key);
+            if (index != m_size && m_keys[index] == key) {
+                return false;
+            }
+            insert_key(index, key);
+            m_counter += 1;
+            return true;
+        }
+
+        size_t index = upper_index(key);
+        if (m_sons[index]->is_full()) {
+            split(index, alloc, tail);
+            if (!(key < m_keys[index])) {
+                index += 1;
+            }
+        }
+        if (m_sons[index]->insert(key, alloc, tail)) {
+            update_count(index, 1);
+            return true;
+        }
+        return false;
+    }
+
+    template <typename Alloc>
+    bool erase(const Key &key, Alloc &alloc, BPlusNode *&tail) {
+        if (m_leaf) {
+            size_t index = lower_index(key);
+            if (index == m_size || m_keys[index] != key) {
+                return false;
+            }
+            erase_key(index);
+            m_counter -= 1;
+            return true;
+        }
+
+        // guarantee that son has at least N keys before descent
+        size_t index = upper_index(key);
+        if (m_sons[index]->m_size == N - 1) {
+            if (index < m_size && m_sons[index + 1]->m_size > N - 1) {
+                rotate_left(index);
+            } else if (index > 0 && m_sons[index - 1]->m_size > N - 1) {
+                rotate_right(index - 1);
+            } else if (index < m_size) {
+                merge(index, alloc, tail);
+            } else {
+                merge(index - 1, alloc, tail);
+                index -= 1;
+            }
+        }
+        if (m_sons[index]->erase(key, alloc, tail)) {
+            update_count(index, -1);
+            return true;
+        }
+        return false;
+    }
+
+  private:
+    void update_count(size_t index, ptrdiff_t delta) {
+        m_counter += delta;
+        for (size_t i = index; i <= m_size; ++i) {
+            m_prefix[i] += delta;
+        }
+    }
+
+    void recount() {
+        if (m_leaf) {
+            m_counter = m_size;
+            return;
+        }
+        size_t counter = 0;
+        for (size_t i = 0; i <= m_size; ++i) {
+            counter += m_sons[i]->m_counter;
+            m_prefix[i] = counter;
+        }
+        m_counter = counter;
+    }
+
+    void insert_key(size_t index, const Key &key) {
+        std::move_backward(m_keys.begin() + index, m_keys.begin() + m_size,
+                           m_keys.begin() + m_size + 1);
+        m_keys[index] = key;
+        m_size += 1;
+    }
+
+    void erase_key(size_t index) {
+        std::move(m_keys.begin() + index + 1, m_keys.begin() + m_size, m_keys.begin() + index);
+        m_size -= 1;
+    }
+
+    // must be called before insert_key
+    void insert_son(size_t index, BPlusNode *son) {
+        std::move_backward(m_sons.begin() + index, m_sons.begin() + m_size + 1,
+                           m_sons.begin() + m_size + 2);
+        m_sons[index] = son;
+    }
+
+    // must be called before erase_key
+    void erase_son(size_t index) {
+        std::move(m_sons.begin() + index + 1, m_sons.begin() + m_size + 1, m_sons.begin() + index);
+    }
+
+    // full leaf keeps N - 1 keys and the first key of its new right brother is
+    // copied up; full internal node moves its middle separator up
+    template <typename Alloc>
+    void split(size_t son_index, Alloc &alloc, BPlusNode *&tail) {
+        BPlusNode *son = m_sons[son_index];
+        BPlusNode *right = create(alloc, son->m_leaf);
+
+        if (son->m_leaf) {
+            right->m_size = N;
+            std::copy(son->m_keys.begin() + N - 1, son->m_keys.begin() + max_keys,
+                      right->m_keys.begin());
+            right->m_prev = son;
+            right->m_next = son->m_next;
+            (son->m_next ? son->m_next->m_prev : tail) = right;
+            son->m_next = right;
+        } else {
+            right->m_size = N - 1;
+            std::copy(son->m_keys.begin() + N, son->m_keys.begin() + max_keys,
+                      right->m_keys.begin());
+            std::copy(son->m_sons.begin() + N, son->m_sons.end(), right->m_sons.begin());
+        }
+        son->m_size = N - 1;
+        son->recount();
+        right->recount();
+
+        insert_son(son_index + 1, right);
+        insert_key(son_index, son->m_leaf ? right->m_keys.front() : son->m_keys[N - 1]);
+        recount();
+    }
+
+    // move first key (and son) of right son to the end of left son
+    void rotate_left(size_t index) {
+        BPlusNode *left = m_sons[index];
+        BPlusNode *right = m_sons[index + 1];
+
+        if (left->m_leaf) {
+            left->m_keys[left->m_size] = right->m_keys.front();
+            right->erase_key(0);
+            m_keys[index] = right->m_keys.front();
+        } else {
+            left->m_keys[left->m_size] = m_keys[index];
+            left->m_sons[left->m_size + 1] = right->m_sons.front();
+            m_keys[index] = right->m_keys.front();
+            right->erase_son(0);
+            right->erase_key(0);
+        }
+        left->m_size += 1;
+        left->recount();
+        right->recount();
+        recount();
+    }
+
+    // move last key (and son) of left son to the front of right son
+    void rotate_right(size_t index) {
+        BPlusNode *left = m_sons[index];
+        BPlusNode *right = m_sons[index + 1];
+
+        if (left->m_leaf) {
+            right->insert_key(0, left->m_keys[left->m_size - 1]);
+            m_keys[index] = right->m_keys.front();
+        } else {
+            right->insert_son(0, left->m_sons[left->m_size]);
+            right->insert_key(0, m_keys[index]);
+            m_keys[index] = left->m_keys[left->m_size - 1];
+        }
+        left->m_size -= 1;
+        left->recount();
+        right->recount();
+        recount();
+    }
+
+    // merge son index + 1 into son index
+    template <typename Alloc>
+    void merge(size_t index, Alloc &alloc, BPlusNode *&tail) {
+        BPlusNode *left = m_sons[index];
+        BPlusNode *right = m_sons[index + 1];
+
+        if (left->m_leaf) {
+            std::copy(right->m_keys.begin(), right->m_keys.begin() + right->m_size,
+                      left->m_keys.begin() + left->m_size);
+            left->m_size += right->m_size;
+            left->m_next = right->m_next;
+            (right->m_next ? right->m_next->m_prev : tail) = left;
+        } else {
+            left->m_keys[left->m_size] = m_keys[index];
+            std::copy(right->m_keys.begin(), right->m_keys.begin() + right->m_size,
+                      left->m_keys.begin() + left->m_size + 1);
+            std::copy(right->m_sons.begin(), right->m_sons.begin() + right->m_size + 1,
+                      left->m_sons.begin() + left->m_size + 1);
+            left->m_size += right->m_size + 1;
+        }
+        left->recount();
+        destroy(alloc, right);
+
+        erase_son(index + 1);
+        erase_key(index);
+        recount();
+    }
+};
+
+// walks the leaf chain, both directions are O(1)
+template <typename NodeT>
+class BPlusIterator final {
+  public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = typename NodeT::value_type;
+    using const_pointer = const value_type *;
+    using const_reference = const value_type &;
+    using const_node_pointer = const NodeT *;
+
+  private:
+    const_node_pointer leaf;
+    size_t position;
+
+  public:
+    BPlusIterator(const_node_pointer leaf, size_t pos) : leaf(leaf), position(pos) {}
+    BPlusIterator() : leaf(nullptr), position(0) {}
+
+    const_reference operator*() const { return leaf->m_keys[position]; }
+    const_pointer operator->() const { return &leaf->m_keys[position]; }
+
+    BPlusIterator &operator++() {
+        position += 1;
+        if (position == leaf->m_size && leaf->m_next) {
+            leaf = leaf->m_next;
+            position = 0;
+        }
+        return *this;
+    }
+    BPlusIterator operator++(int) {
+        BPlusIterator temp = *this;
+        ++(*this);
+        return temp;
+    }
+
+    BPlusIterator &operator--() {
+        if (position == 0) {
+            leaf = leaf->m_prev;
+            position = leaf->m_size;
+        }
+        position -= 1;
+        return *this;
+    }
+    BPlusIterator operator--(int) {
+        BPlusIterator temp = *this;
+        --(*this);
+        return temp;
+    }
+
+    friend bool operator==(const BPlusIterator &lhs, const BPlusIterator &rhs) {
+        return (lhs.leaf == rhs.leaf) && (lhs.position == rhs.position);
+    }
+    friend bool operator!=(const BPlusIterator &lhs, const BPlusIterator &rhs) {
+        return !(lhs == rhs);
+    }
+};
+
+template <typename Key, size_t N, template <typename> typename Allocator = NodePool>
+class BPlusTree final {
+  private:
+    using node_t = BPlusNode<Key, N>;
+    using node_p = node_t *;
+    using value_type = Key;
+    using allocator_t = Allocator<node_t>;
+
+    allocator_t m_alloc;
+    node_p m_root = nullptr;
+    node_p m_head = nullptr; // leftmost leaf
+    node_p m_tail = nullptr; // rightmost leaf
+
+    // copies subtree, leaves are chained after last_leaf in key order
+    node_p deep_copy(node_p other, node_p &last_leaf) {
+        node_p new_node = node_t::create(m_alloc, other->m_leaf);
+        std::copy_n(other->m_keys.begin(), other->m_size, new_node->m_keys.begin());
+        std::copy_n(other->m_prefix.begin(), other->sons_count(), new_node->m_prefix.begin());
+        new_node->m_size = other->m_size;
+        new_node->m_counter = other->m_counter;
+
+        if (other->m_leaf) {
+            new_node->m_prev = last_leaf;
+            (last_leaf ? last_leaf->m_next : m_head) = new_node;
+            last_leaf = new_node;
+        }
+        for (size_t i = 0; i < other->sons_count(); ++i) {
+            new_node->m_sons[i] = deep_copy(other->m_sons[i], last_leaf);
+        }
+        return new_node;
+    }
+
+  public:
+    BPlusTree() = default;
+    BPlusTree(std::initializer_list<Key> list) {
+        for (const Key &key : list) {
+            insert(key);
+        }
+    }
+
+    BPlusTree(BPlusTree &&other)
+        : m_alloc(std::move(other.m_alloc)), m_root(std::exchange(other.m_root, nullptr)),
+          m_head(std::exchange(other.m_head, nullptr)),
+          m_tail(std::exchange(other.m_tail, nullptr)) {}
+
+    BPlusTree(const BPlusTree &other) {
+        if (other.m_root) {
+            m_root = deep_copy(other.m_root, m_tail);
+        }
+    }
+
+    BPlusTree &operator=(const BPlusTree &other) {
+        if (this == std::addressof(other)) {
+            return *this;
+        }
+        BPlusTree temp(other);
+        swap(temp);
+        return *this;
+    }
+    BPlusTree &operator=(BPlusTree &&other) {
+        if (this == std::addressof(other)) {
+            return *this;
+        }
+        BPlusTree temp{std::move(other)};
+        swap(temp);
+        return *this;
+    }
+
+    ~BPlusTree() { clear(); }
+
+    void swap(BPlusTree &other) {
+        std::swap(m_alloc, other.m_alloc);
+        std::swap(m_root, other.m_root);
+        std::swap(m_head, other.m_head);
+        std::swap(m_tail, other.m_tail);
+    }
+
+    void clear() {
+        if (!m_root) {
+            return;
+        }
+        if constexpr (requires { m_alloc.release(); }) {
+            if constexpr (!std::is_trivially_destructible_v<node_t>) {
+                node_t::destroy_subtree(m_alloc, m_root);
+            }
+            m_alloc.release();
+        } else {
+            node_t::destroy_subtree(m_alloc, m_root);
+        }
+        m_root = m_head = m_tail = nullptr;
+    }
+
+    size_t size() const { return m_root ? m_root->count() : 0; }
+    bool empty() const { return !m_root; }
+
+    bool insert(const Key &key) {
+        if (!m_root) {
+            m_root = m_head = m_tail = node_t::create(m_alloc, true);
+        }
+        if (m_root->is_full()) {
+            node_p new_root = node_t::create(m_alloc, false);
+            new_root->m_sons[0] = m_root;
+            m_root = new_root;
+            m_root->split(0, m_alloc, m_tail);
+        }
+        return m_root->insert(key, m_alloc, m_tail);
+    }
+
+    bool erase(const Key &key) {
+        if (!m_root) {
+            return false;
+        }
+        bool erased = m_root->erase(key, m_alloc, m_tail);
+        if (m_root->m_size == 0) {
+            node_p old_root = m_root;
+            m_root = m_root->m_leaf ? nullptr : m_root->m_sons.front();
+            if (!m_root) {
+                m_head = m_tail = nullptr;
+            }
+            node_t::destroy(m_alloc, old_root);
+        }
+        return erased;
+    }
+
+    // number of keys less than key
+    size_t rank(const Key &key) const { return m_root ? m_root->rank(key) : 0; }
+
+    size_t distance(const Key &begin, const Key &end) const {
+        if (!m_root || end <= begin) {
+            return 0;
+        }
+        return m_root->rank(end, true) - m_root->rank(begin);
+    }
+
+    using const_iterator = BPlusIterator<node_t>;
+    using iterator = const_iterator;
+
+    static_assert(std::bidirectional_iterator<const_iterator>);
+
+    const_iterator cbegin() const { return const_iterator(m_head, 0); }
+    const_iterator cend() const {
+        return m_tail ? const_iterator(m_tail, m_tail->m_size) : const_iterator();
+    }
+
+    iterator begin() const { return cbegin(); }
+    iterator end() const { return cend(); }
+
+    const_iterator lower_bound(const Key &key) const {
+        if (!m_root) {
+            return cend();
+        }
+        auto [leaf, index] = m_root->leaf_bound(key, false);
+        return const_iterator(leaf, index);
+    }
+    const_iterator upper_bound(const Key &key) const {
+        if (!m_root) {
+            return cend();
+        }
+        auto [leaf, index] = m_root->leaf_bound(key, true);
+        return const_iterator(leaf, index);
+    }
+
+    const_iterator find(const Key &key) const {
+        auto it = lower_bound(key);
+        return (it == cend() || *it != key) ? cend() : it;
+    }
+
+    // iterator to the k-th smallest key (from zero), end() if k >= size()
+    const_iterator select(size_t k) const {
+        if (k >= size()) {
+            return cend();
+        }
+        auto [leaf, index] = m_root->select(k);
+        return const_iterator(leaf, index);
+    }
+
+    // calls func for every key in [begin, end] walking the leaf chain
+    template <typename Func>
+    void for_each_in(const Key &begin, const Key &end, Func func) const {
+        for (auto it = lower_bound(begin), last = upper_bound(end); it != last; ++it) {
+            func(*it);
+        }
+    }
+};
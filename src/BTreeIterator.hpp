@@ -0,0 +1,180 @@
+#pragma once
+
+#include <cstddef>
+#include <iterator>
+#include <sys/types.h>
+#include <type_traits>
+#include <utility>
+
+// Bidirectional iterator over a tree of NodeT: nodes expose m_keys, m_size,
+// m_leaf, sons_count(), son(index), lower_index/upper_index and item(index),
+// and befriend the iterator. Shared by BTree nodes and mapped images of them.
+// Map nodes keep keys and values apart, so their item is a pair of references.
+// Multiset nodes store a key once with its multiplicity(index), the iterator
+// visits it that many times
+template <typename NodeT>
+class BTreeIterator final {
+  public:
+    using iterator_category = std::bidirectional_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = typename NodeT::value_type;
+    using reference = typename NodeT::reference;
+    using const_node_pointer = const NodeT *;
+
+  private:
+    const_node_pointer root;
+    const_node_pointer node;
+    ssize_t position;
+    // leaf node entered from an internal node is its son_index son; nullptr
+    // when unknown (iterator came from a search or node is internal)
+    const_node_pointer parent = nullptr;
+    size_t son_index = 0;
+    size_t occurrence = 0;
+
+    static constexpr bool counted = requires(const NodeT &node) { node.multiplicity(0); };
+
+    size_t multiplicity() const {
+        if constexpr (counted) {
+            return node->multiplicity(position);
+        } else {
+            return 1;
+        }
+    }
+
+    // descent to the leftmost (or rightmost) leaf of son index of node
+    void descend(size_t index, bool rightmost) {
+        while (!node->m_leaf) {
+            parent = node;
+            son_index = index;
+            node = node->son(index);
+            index = rightmost ? node->sons_count() - 1 : 0;
+        }
+        position = rightmost ? node->m_size - 1 : 0;
+    }
+
+    struct ArrowProxy {
+        reference item;
+        const reference *operator->() const { return &item; }
+    };
+
+  public:
+    BTreeIterator(const_node_pointer root, const_node_pointer node, ssize_t pos,
+                  size_t occurrence = 0)
+        : root(root), node(node), position(pos), occurrence(occurrence) {}
+    BTreeIterator() : root(nullptr), node(nullptr), position(0) {}
+
+    reference operator*() const { return node->item(position); }
+    auto operator->() const {
+        if constexpr (std::is_reference_v<reference>) {
+            return &node->item(position);
+        } else {
+            return ArrowProxy{node->item(position)};
+        }
+    }
+    // nodes may be shared by several trees and have no parent pointer: a
+    // finished leaf continues in the parent it was entered from, or, for the
+    // last son, at the deepest ancestor with a greater key found from root.
+    // end() is (root, root size)
+    BTreeIterator &operator++() {
+        if (occurrence + 1 < multiplicity()) {
+            occurrence += 1;
+            return *this;
+        }
+        occurrence = 0;
+        position += 1;
+        if (!node->m_leaf) {
+            descend(position, false);
+            return *this;
+        }
+        if (position < node->m_size) {
+            return *this;
+        }
+        if (parent && son_index < parent->m_size) {
+            node = std::exchange(parent, nullptr);
+            position = son_index;
+            return *this;
+        }
+        const auto &last = node->m_keys[position - 1];
+        const_node_pointer current = root;
+        node = root;
+        position = root->m_size;
+        parent = nullptr;
+        while (true) {
+            size_t index = current->upper_index(last);
+            if (index != current->m_size) {
+                node = current;
+                position = index;
+            }
+            if (current->m_leaf) {
+                return *this;
+            }
+            current = current->son(index);
+        }
+    }
+    BTreeIterator operator++(int) {
+        BTreeIterator temp = *this;
+        ++(*this);
+        return temp;
+    }
+
+    BTreeIterator &operator--() {
+        if (occurrence != 0) {
+            occurrence -= 1;
+            return *this;
+        }
+        step_back();
+        if (position >= 0 && position < static_cast<ssize_t>(node->m_size)) {
+            occurrence = multiplicity() - 1;
+        }
+        return *this;
+    }
+
+    BTreeIterator operator--(int) {
+        BTreeIterator temp = *this;
+        --(*this);
+        return temp;
+    };
+
+    friend bool operator==(const BTreeIterator &lhs, const BTreeIterator &rhs) {
+        return (lhs.node == rhs.node) && (lhs.position == rhs.position) &&
+               (lhs.occurrence == rhs.occurrence);
+    }
+    friend bool operator!=(const BTreeIterator &lhs, const BTreeIterator &rhs) {
+        return !(lhs == rhs);
+    }
+
+  private:
+    // previous key, or position -1 of root before the first one
+    void step_back() {
+        if (!node->m_leaf) {
+            descend(position, true);
+            return;
+        }
+        if (position != 0) {
+            position -= 1;
+            return;
+        }
+        if (parent && son_index != 0) {
+            node = std::exchange(parent, nullptr);
+            position = son_index - 1;
+            return;
+        }
+        // deepest ancestor with a key less than the first key of leaf
+        const auto &first = node->m_keys[0];
+        const_node_pointer current = root;
+        node = root;
+        position = -1;
+        parent = nullptr;
+        while (true) {
+            size_t index = current->lower_index(first);
+            if (index != 0) {
+                node = current;
+                position = index - 1;
+            }
+            if (current->m_leaf) {
+                return;
+            }
+            current = current->son(index);
+        }
+    }
+};
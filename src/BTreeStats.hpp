@@ -0,0 +1,52 @@
+#pragma once
+
+#include <cstddef>
+#include <cstdint>
+#include <vector>
+
+// Operation counters are compiled in with -DBTREE_STATS=1 (cmake option
+// BTREE_STATS), otherwise counting expands to nothing
+#ifndef BTREE_STATS
+#define BTREE_STATS 0
+#endif
+
+// events of all trees of the calling thread since the last reset
+struct OperationCounters {
+    uint64_t operations = 0;    // public calls that descend the tree
+    uint64_t nodes_visited = 0; // nodes examined by those calls
+    uint64_t splits = 0;
+    uint64_t merges = 0;
+    uint64_t rotations = 0; // keys borrowed from a brother during erase
+
+    double nodes_per_operation() const {
+        return operations == 0 ? 0 : static_cast<double>(nodes_visited) / operations;
+    }
+
+    void reset() { *this = {}; }
+};
+
+inline OperationCounters &operation_counters() {
+    static thread_local OperationCounters counters;
+    return counters;
+}
+
+#if BTREE_STATS
+#define BTREE_COUNT(counter, value) (operation_counters().counter += (value))
+#else
+#define BTREE_COUNT(counter, value) static_cast<void>(0)
+#endif
+
+// shape of a tree, levels are numbered from the root
+struct TreeStats {
+    size_t height = 0;
+    size_t nodes = 0;
+    size_t keys = 0;
+    // keys stored on each level divided by capacity of its nodes
+    std::vector<double> fill;
+    // heap bytes taken by key, son and value arrays of all nodes, and by
+    // whole nodes
+    size_t key_bytes = 0;
+    size_t son_bytes = 0;
+    size_t value_bytes = 0;
+    size_t node_bytes = 0;
+};
@@ -1,243 +1,758 @@
+#pragma once
+
+#include "Aggregates.hpp"
+#include "BTreeIterator.hpp"
+#include "BTreeStats.hpp"
+#include "FrozenBTree.hpp"
+#include "MappedBTree.hpp"
+#include "NodePool.hpp"
+#include "NodeSearch.hpp"
+
 #include <algorithm>
+#include <array>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
 #include <cstring>
 #include <fstream>
+#include <functional>
 #include <iostream>
 #include <iterator>
+#include <memory>
+#include <numeric>
+#include <span>
+#include <stdexcept>
+#include <string>
+#include <type_traits>
 #include <utility>
 #include <vector>
 
-template <typename Key, size_t N>
+template <typename Key, size_t N, template <typename> typename Allocator, typename Compare,
+          typename Value, typename Aggregate>
 class BTree;
 
-template <typename Key, size_t N>
-struct Node final {
+// lookups may take any key type Compare can order against Key
+template <typename Compare>
+concept transparent_compare = requires { typename Compare::is_transparent; };
+
+// value storage of set nodes
+struct NoValues {};
+
+template <typename Value, size_t Size>
+struct ValueArray {
+    using type = std::array<Value, Size>;
+};
+
+template <size_t Size>
+struct ValueArray<void, Size> {
+    using type = NoValues;
+};
+
+// Value of multiset nodes: every key is stored once with the number of its
+// occurrences in the value array
+struct Multiplicity {};
+
+template <size_t Size>
+struct ValueArray<Multiplicity, Size> {
+    using type = std::array<size_t, Size>;
+};
+
+// aggregates of a custom policy: one per son subtree and one of the node's
+// whole subtree
+template <typename Aggregate, size_t Sons>
+struct AggregateBlock {
+    std::array<typename Aggregate::type, Sons> sons;
+    typename Aggregate::type total = Aggregate::identity();
+};
+
+// CountAggregate is answered from m_counter and m_prefix
+struct NoAggregates {};
+
+// Keys are ordered by a default constructed Compare, so a comparator can't
+// carry state. Map nodes (Value is not void) keep values in a parallel array
+// at the end of the node, key searches don't touch it. Multiset nodes
+// (Value is Multiplicity) count each key with its multiplicity in m_counter
+// and m_prefix. Aggregate is the monoid kept per subtree, see Aggregates.hpp
+template <typename Key, size_t N, typename Compare = std::less<Key>, typename Value = void,
+          typename Aggregate = CountAggregate>
+struct alignas(64) Node final {
   private:
-    using keys_t = std::vector<Key>;
-    using sons_t = std::vector<Node *>;
+    static_assert(N >= 2, "BTree degree must be at least 2");
+
+    static constexpr size_t max_keys = 2 * N - 1;
+    static constexpr size_t max_sons = 2 * N;
+    static constexpr bool has_values = !std::is_void_v<Value>;
+    static constexpr bool custom_aggregate = !std::is_same_v<Aggregate, CountAggregate>;
+    static constexpr bool weighted = std::is_same_v<Value, Multiplicity>;
+    // items are key and value pairs
+    static constexpr bool paired = has_values && !weighted;
 
-    friend BTree<Key, N>;
+    static_assert(!weighted || !custom_aggregate, "multisets keep only counts");
+
+    using search_t = NodeSearch<Key, Compare>;
+
+    // keys and sons live inline, so a node visit touches one contiguous block;
+    // the key block is padded to whole SIMD vectors for NodeSearch
+    using keys_t = std::array<Key, search_t::capacity(max_keys)>;
+    using sons_t = std::array<Node *, max_sons>;
+    using prefix_t = std::array<size_t, max_sons>;
+    using values_t = typename ValueArray<Value, max_keys>::type;
+    using aggregates_t =
+        std::conditional_t<custom_aggregate, AggregateBlock<Aggregate, max_sons>, NoAggregates>;
+
+    template <typename, size_t, template <typename> typename, typename, typename, typename>
+    friend class BTree;
+    friend BTreeIterator<Node>;
 
     keys_t m_keys;
     sons_t m_sons;
+    // internal nodes: m_prefix[i] is the number of subtree keys before key i,
+    // so sons[0..i] and keys[0..i) together; m_prefix[m_size] == m_counter.
+    // Keys of multisets are counted as many times as they occur
+    prefix_t m_prefix;
     size_t m_counter = 0; // sizeof subtree
-    Node *m_parent = nullptr;
+    // nodes are shared between a tree and its snapshots, so there is no
+    // parent pointer; a node is modified in place only while m_refs == 1
+    mutable std::atomic<uint32_t> m_refs = 1;
+    uint32_t m_size = 0; // number of keys in node
+    bool m_leaf = true;
+    [[no_unique_address]] aggregates_t m_aggregates;
+    [[no_unique_address]] values_t m_values;
 
   public:
+    using aggregate_t = typename Aggregate::type;
+    using mapped_type =
+        std::conditional_t<weighted, size_t, std::conditional_t<has_values, Value, NoValues>>;
+    using value_type = std::conditional_t<paired, std::pair<Key, mapped_type>, Key>;
+    using reference =
+        std::conditional_t<paired, std::pair<const Key &, const mapped_type &>, const Key &>;
+
+    // where insert put the key, or where it found it
+    struct InsertResult {
+        Node *node;
+        size_t index;
+        bool inserted;
+    };
+
+    // descent of an insert from the root: son index taken in every internal
+    // node, then the leaf with the index of the key
+    struct Step {
+        Node *node;
+        size_t index;
+    };
+    using Path = std::vector<Step>;
+
+    // occurrence of the key at index, always 0 outside of multisets
+    struct Position {
+        const Node *node;
+        size_t index;
+        size_t occurrence;
+    };
+
+    // point of a batched rank query: rank is the number of keys less than key,
+    // or not greater than key for upper probes
+    struct RankProbe {
+        Key key;
+        bool upper;
+        size_t *rank;
+    };
+
     Node() = default;
+    explicit Node(bool leaf) : m_leaf(leaf) {}
     Node(const Node &) = delete;
     Node(Node &&) = delete;
 
-    Node(const keys_t &keys, const sons_t &sons, size_t size, Node *parent = nullptr)
-        : m_keys(keys), m_sons(sons), m_counter(size), m_parent(parent) {}
-
-    Node(keys_t &&other_keys, sons_t &&other_sons, size_t size) noexcept
-        : m_keys(std::move(other_keys)), m_sons(std::move(other_sons)), m_counter(size) {}
-
     Node &operator=(const Node &rhs) = delete;
     Node &operator=(Node &&rhs) = delete;
 
-    ~Node() {
-        for (Node *son : m_sons) {
-            delete son;
-        }
+    ~Node() = default;
+
+    template <typename Alloc>
+    static Node *create(Alloc &alloc, bool leaf) {
+        return ::new (static_cast<void *>(alloc.allocate())) Node(leaf);
     }
 
-    // returns number of keys in subtree with this node as root
-    size_t lower_count(const Key &key) const {
-        auto result = std::lower_bound(m_keys.begin(), m_keys.end(), key);
-        size_t index = result - m_keys.begin();
-        size_t counter = m_keys.size() - index;
+    template <typename Alloc>
+    static void destroy(Alloc &alloc, Node *node) {
+        node->~Node();
+        alloc.deallocate(node);
+    }
 
-        if (m_sons.empty()) {
-            return counter;
+    template <typename Alloc>
+    static void destroy_subtree(Alloc &alloc, Node *node) {
+        for (Node *son : node->sons()) {
+            destroy_subtree(alloc, son);
         }
-        for (int i = index + 1; i < m_sons.size(); ++i) {
-            counter += m_sons[i]->count();
+        destroy(alloc, node);
+    }
+
+    // drops one reference, the last one destroys node and releases its sons
+    template <typename Alloc>
+    static void unref(Alloc &alloc, const Node *node) {
+        if (node->m_refs.fetch_sub(1, std::memory_order_acq_rel) != 1) {
+            return;
+        }
+        for (Node *son : node->sons()) {
+            unref(alloc, son);
         }
+        destroy(alloc, const_cast<Node *>(node));
+    }
 
-        if (result == m_keys.end() || (result != m_keys.end() && *result != key)) {
-            counter += m_sons[index]->lower_count(key);
+    // private copy of node sharing its sons
+    template <typename Alloc>
+    Node *clone(Alloc &alloc) const {
+        Node *copy = create(alloc, m_leaf);
+        copy->copy_contents(*this);
+        std::copy_n(m_sons.begin(), sons_count(), copy->m_sons.begin());
+        for (Node *son : sons()) {
+            son->m_refs.fetch_add(1, std::memory_order_relaxed);
         }
-        return counter;
+        return copy;
     }
-    size_t upper_count(const Key &key) const {
-        auto result = std::upper_bound(m_keys.begin(), m_keys.end(), key);
-        size_t index = result - m_keys.begin();
-        size_t counter = index;
 
-        if (m_sons.empty()) {
-            return counter;
+    bool is_shared() const { return m_refs.load(std::memory_order_acquire) != 1; }
+
+    size_t size() const { return m_size; }
+    size_t sons_count() const { return m_leaf ? 0 : m_size + 1; }
+    bool is_leaf() const { return m_leaf; }
+    bool is_full() const { return m_size == max_keys; }
+
+    std::span<const Key> keys() const { return {m_keys.data(), m_size}; }
+    reference item(size_t index) const {
+        if constexpr (paired) {
+            return {m_keys[index], m_values[index]};
+        } else {
+            return m_keys[index];
         }
-        for (int i = 0; i < index; ++i) {
-            counter += m_sons[i]->count();
+    }
+    std::span<Node *const> sons() const { return {m_sons.data(), sons_count()}; }
+    const Node *son(size_t index) const { return m_sons[index]; }
+
+    size_t multiplicity(size_t index) const
+        requires weighted
+    {
+        return m_values[index];
+    }
+
+    template <typename L, typename R>
+    static bool less(const L &lhs, const R &rhs) {
+        return Compare{}(lhs, rhs);
+    }
+
+    // index of first key not less than key
+    template <typename K>
+    size_t lower_index(const K &key) const {
+        return search_t::lower_index(m_keys.data(), m_size, key);
+    }
+    // index of first key greater than key
+    template <typename K>
+    size_t upper_index(const K &key) const {
+        return search_t::upper_index(m_keys.data(), m_size, key);
+    }
+
+    // number of keys in subtree less than key
+    template <typename K>
+    size_t rank(const K &key) const {
+        size_t counter = 0;
+        const Node *node = this;
+        while (true) {
+            BTREE_COUNT(nodes_visited, 1);
+            size_t index = node->lower_index(key);
+            if (node->m_leaf) {
+                return counter + node->leaf_rank(index);
+            }
+            if (index != node->m_size && !less(key, node->m_keys[index])) {
+                return counter + node->m_prefix[index];
+            }
+            counter += node->son_offset(index);
+            node = node->m_sons[index];
         }
-        if (result == m_keys.end() || (result != m_keys.end() && *result != key)) {
-            counter += m_sons[index]->upper_count(key);
+    }
+
+    // returns number of keys in subtree with this node as root
+    template <typename K>
+    size_t lower_count(const K &key) const {
+        return m_counter - rank(key);
+    }
+    template <typename K>
+    size_t upper_count(const K &key) const {
+        size_t counter = 0;
+        const Node *node = this;
+        while (true) {
+            BTREE_COUNT(nodes_visited, 1);
+            size_t index = node->upper_index(key);
+            if (node->m_leaf) {
+                return counter + node->leaf_rank(index);
+            }
+            if (index != 0 && !less(node->m_keys[index - 1], key)) {
+                return counter + node->son_offset(index);
+            }
+            counter += node->son_offset(index);
+            node = node->m_sons[index];
         }
-        return counter;
     }
 
     size_t count() const { return m_counter; }
 
-    size_t distance(const Key &begin, const Key &end) const {
-        auto first = std::lower_bound(m_keys.begin(), m_keys.end(), begin);
-        auto second = std::lower_bound(m_keys.begin(), m_keys.end(), end);
-
-        size_t counter = second - first + 1;
-        size_t left_bound = first - m_keys.begin();
-        size_t right_bound = second - m_keys.begin();
-        if (m_sons.empty()) {
-            if (second == m_keys.end() || *second != end) {
-                counter -= 1;
+    template <typename K>
+    size_t distance(const K &begin, const K &end) const {
+        const Node *node = this;
+        // descend while the whole range lies inside one son
+        while (!node->m_leaf) {
+            BTREE_COUNT(nodes_visited, 1);
+            size_t index = node->lower_index(begin);
+            if (index != node->upper_index(end)) {
+                break;
             }
-            return counter;
+            node = node->m_sons[index];
         }
+        return node->upper_count(end) - node->rank(begin);
+    }
 
-        if (first == m_keys.end()) {
-            return m_sons.back()->distance(begin, end);
+    // aggregate of the whole subtree
+    aggregate_t total() const {
+        if constexpr (custom_aggregate) {
+            return m_aggregates.total;
+        } else {
+            return m_counter;
         }
+    }
 
-        if (first == second) {
-            if (*first != begin && *second != end) {
-                return m_sons[left_bound]->distance(begin, end);
+    // aggregate of subtree keys in [begin, end], begin < end
+    template <typename K>
+    aggregate_t aggregate(const K &begin, const K &end) const {
+        if constexpr (!custom_aggregate) {
+            return distance(begin, end);
+        } else {
+            const Node *node = this;
+            // descend while the whole range lies inside one son
+            while (!node->m_leaf) {
+                BTREE_COUNT(nodes_visited, 1);
+                size_t index = node->lower_index(begin);
+                if (index != node->upper_index(end)) {
+                    break;
+                }
+                node = node->m_sons[index];
             }
-            if (*first == begin && *second == end) {
-                return counter;
+            size_t first = node->lower_index(begin);
+            size_t last = node->upper_index(end);
+            aggregate_t result = node->combine_span(first, last);
+            if (node->m_leaf) {
+                return result;
             }
+            if (less(begin, node->m_keys[first])) {
+                result = Aggregate::combine(node->m_sons[first]->suffix(begin), result);
+            }
+            return Aggregate::combine(result, node->m_sons[last]->prefix(end));
         }
-        if (*first != begin) {
-            counter += m_sons[left_bound]->lower_count(begin);
-        }
-        if (second == m_keys.end() || *second != end) {
-            counter += m_sons[right_bound]->upper_count(end);
-            right_bound -= 1;
-            counter -= 1;
+    }
+
+    // answers probes sorted by key, neighbouring probes share the descent
+    void rank_batch(std::span<RankProbe> probes, size_t offset = 0) const {
+        BTREE_COUNT(nodes_visited, 1);
+        auto it = probes.begin();
+        while (it != probes.end()) {
+            size_t index = it->upper ? upper_index(it->key) : lower_index(it->key);
+            if (m_leaf) {
+                *it->rank = offset + leaf_rank(index);
+                ++it;
+                continue;
+            }
+            if (!it->upper && index != m_size && !less(it->key, m_keys[index])) {
+                *it->rank = offset + m_prefix[index];
+                ++it;
+                continue;
+            }
+            if (it->upper && index != 0 && !less(m_keys[index - 1], it->key)) {
+                *it->rank = offset + son_offset(index);
+                ++it;
+                continue;
+            }
+            // probes between keys[index - 1] and keys[index] all go to the same son
+            auto run_end = probes.end();
+            if (index != m_size) {
+                run_end = std::partition_point(it, probes.end(), [&](const RankProbe &probe) {
+                    return less(probe.key, m_keys[index]);
+                });
+            }
+            m_sons[index]->rank_batch({it, run_end}, offset + son_offset(index));
+            it = run_end;
         }
-        for (int i = left_bound + 1; i < right_bound + 1; ++i) {
-            counter += m_sons[i]->count();
+    }
+
+    // descents in flight at once in interleave
+    static constexpr size_t interleave_width = 16;
+
+    // asks for the lines a search of node reads first: the keys and the line
+    // with m_size and m_leaf
+    static void prefetch(const Node *node) {
+        const char *keys = reinterpret_cast<const char *>(node->m_keys.data());
+        for (size_t line = 0; line < sizeof(keys_t); line += 64) {
+            __builtin_prefetch(keys + line);
         }
-        return counter;
+        __builtin_prefetch(&node->m_size);
     }
 
-    BTree<Key, N>::const_iterator find(const Key &key) const {
-        auto result = std::lower_bound(m_keys.begin(), m_keys.end(), key);
-        if (result != m_keys.end()) {
-            if (*result == key) {
-                return {this, result - m_keys.begin()};
-            } else if (!m_sons.empty()) {
-                return m_sons[result - m_keys.begin()]->find(key);
-            }
-            return {};
+    // Runs the descents of all probes from root, a group of interleave_width
+    // of them in lock-step: step(probe, node) visits one node and returns the
+    // son to go on with, or nullptr when the probe is answered. The son is
+    // prefetched before the other probes of the group take their step, so
+    // their cache misses overlap instead of following one another
+    template <typename Probe, typename Step>
+    static void interleave(const Node *root, std::span<Probe> probes, Step step) {
+        std::array<std::pair<Probe *, const Node *>, interleave_width> lanes;
+        size_t active = 0;
+        size_t next = 0;
+        while (active != lanes.size() && next != probes.size()) {
+            lanes[active++] = {&probes[next++], root};
         }
-        if (!m_sons.empty()) {
-            return m_sons.back()->find(key);
+        while (active != 0) {
+            for (size_t lane = 0; lane < active;) {
+                auto &[probe, node] = lanes[lane];
+                node = step(*probe, node);
+                if (node) {
+                    prefetch(node);
+                    ++lane;
+                } else if (next != probes.size()) {
+                    // the root stays cached, so a new probe starts right away
+                    lanes[lane] = {&probes[next++], root};
+                    ++lane;
+                } else {
+                    lanes[lane] = lanes[--active];
+                }
+            }
         }
-        return {};
     }
 
-    BTree<Key, N>::iterator find(const Key &key) { return std::as_const(*this).find(key); }
+    // answers probes in any order, *probe.rank must start at zero
+    void rank_interleaved(std::span<RankProbe> probes) const {
+        interleave(this, probes, [](const RankProbe &probe, const Node *node) -> const Node * {
+            BTREE_COUNT(nodes_visited, 1);
+            size_t index =
+                probe.upper ? node->upper_index(probe.key) : node->lower_index(probe.key);
+            if (node->m_leaf) {
+                *probe.rank += node->leaf_rank(index);
+                return nullptr;
+            }
+            if (!probe.upper && index != node->m_size && !less(probe.key, node->m_keys[index])) {
+                *probe.rank += node->m_prefix[index];
+                return nullptr;
+            }
+            if (probe.upper && index != 0 && !less(node->m_keys[index - 1], probe.key)) {
+                *probe.rank += node->son_offset(index);
+                return nullptr;
+            }
+            *probe.rank += node->son_offset(index);
+            return node->m_sons[index];
+        });
+    }
 
-    bool insert(const Key &key) {
-        auto result = std::lower_bound(m_keys.begin(), m_keys.end(), key);
-        size_t index = result - m_keys.begin();
-        m_counter += 1; // update node counter
+    // point of an interleaved find: found is the key's position, {} if the
+    // subtree has no such key
+    struct FindProbe {
+        const Key *key;
+        BTreeIterator<Node> *found;
+    };
 
-        if (m_sons.size() > index) {
-            if (m_sons[index]->m_keys.size() == 2 * N - 1) {
-                split(index);
+    void find_interleaved(std::span<FindProbe> probes) const {
+        interleave(this, probes, [this](const FindProbe &probe, const Node *node) -> const Node * {
+            BTREE_COUNT(nodes_visited, 1);
+            size_t index = node->lower_index(*probe.key);
+            if (index != node->m_size && !less(*probe.key, node->m_keys[index])) {
+                *probe.found = {this, node, static_cast<ssize_t>(index)};
+                return nullptr;
             }
-            if (index == m_keys.size()) {
-                return m_sons.back()->insert(key);
+            if (node->m_leaf) {
+                *probe.found = {};
+                return nullptr;
             }
+            return node->m_sons[index];
+        });
+    }
 
-            if (m_keys[index] >= key) {
-                return m_sons[index]->insert(key);
+    // position of the key with given rank in subtree, rank < count()
+    Position select(size_t rank) const {
+        const Node *node = this;
+        while (!node->m_leaf) {
+            BTREE_COUNT(nodes_visited, 1);
+            // key index - 1 takes ranks from m_prefix[index - 1] up to son index
+            size_t index = std::upper_bound(node->m_prefix.begin(),
+                                            node->m_prefix.begin() + node->m_size + 1, rank) -
+                           node->m_prefix.begin();
+            if (index != 0 && rank < node->son_offset(index)) {
+                return {node, index - 1, rank - node->m_prefix[index - 1]};
             }
-            return m_sons[index + 1]->insert(key);
+            rank -= node->son_offset(index);
+            node = node->m_sons[index];
         }
-        if (result == m_keys.end() || *result != key) {
-            m_keys.insert(result, key);
-            return true;
+        size_t index = 0;
+        if constexpr (weighted) {
+            while (rank >= node->m_values[index]) {
+                rank -= node->m_values[index];
+                index += 1;
+            }
+            return {node, index, rank};
         }
-        m_counter -= 1;
-        return false;
+        return {node, rank, 0};
     }
 
-    bool erase(const Key &key) {
-        auto result = std::lower_bound(m_keys.begin(), m_keys.end(), key);
-        size_t index = result - m_keys.begin();
-        m_counter -= 1;
-
-        if (m_sons.empty()) {
-            if (result != m_keys.end() && *result != key) {
-                m_counter += 1;
-                return false;
+    // first key not less than key (or greater than key if upper), {} if none
+    template <typename K>
+    BTreeIterator<Node> bound(const K &key, bool upper) const {
+        BTreeIterator<Node> result;
+        const Node *node = this;
+        while (true) {
+            BTREE_COUNT(nodes_visited, 1);
+            size_t index = upper ? node->upper_index(key) : node->lower_index(key);
+            if (index != node->m_size) {
+                result = {this, node, static_cast<ssize_t>(index)};
+                if (!upper && !less(key, node->m_keys[index])) {
+                    return result;
+                }
             }
-            // leaf node
-            m_keys.erase(result);
-            return true;
+            if (node->m_leaf) {
+                return result;
+            }
+            node = node->m_sons[index];
         }
+    }
 
-        if (result != m_keys.end() && *result == key) {
-            // take key from mostleft son
-            if (m_sons[index]->m_keys.size() > N - 1) {
-                *result = max(m_sons[index + 1]);
-                return m_sons[index]->erase(*result);
+    // number of occurrences of key in subtree
+    template <typename K>
+    size_t occurrences(const K &key) const {
+        const Node *node = this;
+        while (true) {
+            BTREE_COUNT(nodes_visited, 1);
+            size_t index = node->lower_index(key);
+            if (index != node->m_size && !less(key, node->m_keys[index])) {
+                return node->weight(index);
             }
-            // take key from mostright son
-            if (m_sons[index + 1]->m_keys.size() > N - 1) {
-                *result = min(m_sons[index]);
-                return m_sons[index + 1]->erase(*result);
+            if (node->m_leaf) {
+                return 0;
             }
-            erase_helper(index, index + 1);
-            return m_sons[index]->erase(key);
+            node = node->m_sons[index];
         }
+    }
 
-        // delete key from son node
-        if (m_sons[index]->m_keys.size() == N - 1) {
-            if (index < m_sons.size() - 1 && m_sons[index + 1]->m_keys.size() == N) {
-                // take key from right son
-                m_sons[index]->m_keys.push_back(m_keys[index]);
+    template <typename K>
+    BTreeIterator<Node> find(const K &key) const {
+        const Node *node = this;
+        while (true) {
+            BTREE_COUNT(nodes_visited, 1);
+            size_t index = node->lower_index(key);
+            if (index != node->m_size && !less(key, node->m_keys[index])) {
+                return {this, node, static_cast<ssize_t>(index)};
+            }
+            if (node->m_leaf) {
+                return {};
+            }
+            node = node->m_sons[index];
+        }
+    }
 
-                if (!m_sons[index]->m_sons.empty()) {
-                    m_sons[index]->m_sons.push_back(m_sons[index + 1]->m_sons.front());
-                    m_sons[index + 1]->m_sons.erase(m_sons.begin());
-                }
+    // key is forwarded to the leaf, so an rvalue is moved into place; map
+    // nodes construct the value from args only if the key is inserted.
+    // Multiset args are the number of occurrences to add, a present key
+    // counts them and is reported as inserted. The descent is appended to
+    // path unless it is null
+    template <typename K, typename Alloc, typename... Args>
+    InsertResult insert(K &&key, Alloc &alloc, Path *path, Args &&...args) {
+        BTREE_COUNT(nodes_visited, 1);
+        size_t index = lower_index(key);
+        if (index != m_size && !less(key, m_keys[index])) {
+            return insert_found(index, args...);
+        }
+        if (m_leaf) {
+            m_counter += added_keys(args...);
+            insert_key(index, std::forward<K>(key), std::forward<Args>(args)...);
+            reaggregate();
+            if (path) {
+                path->push_back({this, index});
+            }
+            return {this, index, true};
+        }
 
-                m_keys[index] = m_sons[index + 1]->m_keys.front();
-                m_sons[index + 1]->m_keys.erase(m_sons[index + 1]->m_keys.begin());
+        if (own_son(index, alloc)->is_full()) {
+            split(index, alloc);
+            if (less(m_keys[index], key)) {
+                index += 1;
+            } else if (!less(key, m_keys[index])) {
+                return insert_found(index, args...);
+            }
+        }
+        if (path) {
+            path->push_back({this, index});
+        }
+        size_t added = added_keys(args...);
+        auto result =
+            m_sons[index]->insert(std::forward<K>(key), alloc, path, std::forward<Args>(args)...);
+        if (result.inserted) {
+            update_count(index, added);
+        }
+        return result;
+    }
 
-                m_sons[index + 1]->m_counter -= 1;
-                m_sons[index]->m_counter += 1;
+    // Insert that skips the upper levels for nearly sorted keys: path is the
+    // descent of an earlier insert and is checked link by link from root.
+    // The new descent starts at the deepest node on it whose separators still
+    // enclose key and that has room for a key split off below; ancestors of
+    // that node only add the new keys to their counters. Every reused node
+    // must be owned by this tree alone. root must not be full, path is
+    // replaced by the new descent
+    template <typename K, typename Alloc, typename... Args>
+    static InsertResult insert_along(Node *root, Path &path, K &&key, Alloc &alloc,
+                                     Args &&...args) {
+        size_t start = 0;
+        if (!path.empty() && path.front().node == root) {
+            for (size_t level = 0; level + 1 < path.size(); ++level) {
+                auto [node, index] = path[level];
+                Node *son = path[level + 1].node;
+                if (node->m_leaf || index > node->m_size || node->m_sons[index] != son ||
+                    son->is_shared() || (index != 0 && !less(node->m_keys[index - 1], key)) ||
+                    (index != node->m_size && !less(key, node->m_keys[index]))) {
+                    break;
+                }
+                if (!son->is_full()) {
+                    start = level + 1;
+                }
+            }
+        }
+        Node *node = start == 0 ? root : path[start].node;
+        path.resize(start);
+        auto result = node->insert(std::forward<K>(key), alloc, &path, std::forward<Args>(args)...);
+        if (result.inserted) {
+            size_t added = added_keys(args...);
+            for (size_t level = start; level-- != 0;) {
+                path[level].node->update_count(path[level].index, added);
+            }
+        }
+        return result;
+    }
 
-            } else if (index > 0 && m_sons[index - 1]->m_keys.size() == N) {
-                // take key from left son
-                m_sons[index]->m_keys.insert(m_sons[index]->m_keys.begin(), m_keys[index]);
+    // inserts a prefix of sorted unique keys sharing the descent between
+    // neighbours; stops when a full son has to be split but this node is full
+    // too. Returns number of keys consumed, inserted ones are added to inserted
+    template <typename Alloc>
+    size_t insert_batch(std::span<const Key> keys, Alloc &alloc, size_t &inserted) {
+        BTREE_COUNT(nodes_visited, 1);
+        size_t consumed = 0;
+        if (m_leaf) {
+            size_t size = m_size;
+            for (; consumed < keys.size() && !is_full(); ++consumed) {
+                size_t index = lower_index(keys[consumed]);
+                if (index == m_size || less(keys[consumed], m_keys[index])) {
+                    insert_key(index, keys[consumed]);
+                }
+            }
+            m_counter += m_size - size;
+            inserted += m_size - size;
+            reaggregate();
+            return consumed;
+        }
 
-                if (!m_sons[index]->m_sons.empty()) {
-                    m_sons[index]->m_sons.insert(m_sons[index]->m_sons.begin(),
-                                                 m_sons[index - 1]->m_sons.back());
+        while (consumed < keys.size()) {
+            size_t index = lower_index(keys[consumed]);
+            if (index != m_size && !less(keys[consumed], m_keys[index])) {
+                consumed += 1;
+                continue;
+            }
+            if (own_son(index, alloc)->is_full()) {
+                if (is_full()) {
+                    break;
+                }
+                split(index, alloc);
+                continue;
+            }
+            auto rest = keys.subspan(consumed);
+            size_t run = rest.size();
+            if (index != m_size) {
+                run = std::lower_bound(rest.begin(), rest.end(), m_keys[index], Compare{}) -
+                      rest.begin();
+            }
+            size_t son_inserted = 0;
+            consumed += m_sons[index]->insert_batch(rest.first(run), alloc, son_inserted);
+            update_count(index, son_inserted);
+            inserted += son_inserted;
+        }
+        return consumed;
+    }
 
-                    m_sons[index - 1]->m_sons.pop_back();
+    // value of an erased map key is moved to taken unless it is null. A
+    // multiset key loses limit occurrences and is removed when no more are
+    // left. Returns number of keys removed, occurrences for multisets
+    template <typename Alloc>
+    size_t erase(const Key &key, Alloc &alloc, mapped_type *taken = nullptr,
+                 size_t limit = SIZE_MAX) {
+        BTREE_COUNT(nodes_visited, 1);
+        size_t index = lower_index(key);
+        bool found = index != m_size && !less(key, m_keys[index]);
+
+        if constexpr (weighted) {
+            if (found && m_values[index] > limit) {
+                add_weight(index, -static_cast<ptrdiff_t>(limit));
+                return limit;
+            }
+        }
+        if (m_leaf) {
+            if (!found) {
+                return 0;
+            }
+            size_t removed = weight(index);
+            if constexpr (has_values) {
+                if (taken) {
+                    *taken = std::move(m_values[index]);
                 }
+            }
+            erase_key(index);
+            m_counter -= removed;
+            reaggregate();
+            return removed;
+        }
 
-                m_keys[index] = m_sons[index - 1]->m_keys.back();
-                m_sons[index - 1]->m_keys.pop_back();
+        if (found) {
+            size_t removed = weight(index);
+            // replace key with predecessor from left son
+            if (m_sons[index]->m_size > N - 1) {
+                m_keys[index] = max(m_sons[index]);
+                own_son(index, alloc)->erase(m_keys[index], alloc, value_slot(index));
+                replaced_count(index);
+                return removed;
+            }
+            // replace key with successor from right son
+            if (m_sons[index + 1]->m_size > N - 1) {
+                m_keys[index] = min(m_sons[index + 1]);
+                own_son(index + 1, alloc)->erase(m_keys[index], alloc, value_slot(index));
+                replaced_count(index + 1);
+                return removed;
+            }
+            erase_helper(index, index + 1, alloc);
+            m_sons[index]->erase(key, alloc, taken);
+            update_count(index, -static_cast<ptrdiff_t>(removed));
+            return removed;
+        }
 
-                m_sons[index - 1]->m_counter -= 1;
-                m_sons[index]->m_counter += 1;
-            } else {
+        // guarantee that son has at least N keys before descent
+        if (own_son(index, alloc)->m_size == N - 1) {
+            if (index < m_size && m_sons[index + 1]->m_size > N - 1) {
+                own_son(index + 1, alloc);
+                rotate_left(index);
+            } else if (index > 0 && m_sons[index - 1]->m_size > N - 1) {
+                own_son(index - 1, alloc);
+                rotate_right(index - 1);
+            } else if (index < m_size) {
                 // merge with right brother
-                if (index < m_sons.size() - 1) {
-                    erase_helper(index, index + 1);
-                    return m_sons[index]->erase(key);
-                }
+                erase_helper(index, index + 1, alloc);
+            } else {
                 // merge with left brother
-                erase_helper(index - 1, index);
-                return m_sons[index - 1]->erase(key);
+                erase_helper(index - 1, index, alloc);
+                index -= 1;
             }
         }
-        return m_sons[index]->erase(key);
+        size_t removed = m_sons[index]->erase(key, alloc, taken, limit);
+        if (removed != 0) {
+            update_count(index, -static_cast<ptrdiff_t>(removed));
+        }
+        return removed;
     }
 
     template <typename CharT>
@@ -245,139 +760,699 @@ struct Node final {
         out << "\tnode" << this << " [shape=Mrecord, label=\"{";
         out << " size: " << m_counter << " | { ";
 
-        for (size_t i = 0; i < m_keys.size() - 1; ++i) {
+        for (size_t i = 0; i + 1 < m_size; ++i) {
             out << m_keys[i] << " | ";
         }
-        out << m_keys.back() << " }}\"]\n";
-        if (!m_sons.empty()) {
-            for (const Node *son : m_sons) {
-                out << "\tnode" << this << " -> node" << son << "[weight=100]\n";
-                son->dump(out);
-            }
+        out << m_keys[m_size - 1] << " }}\"]\n";
+        for (const Node *son : sons()) {
+            out << "\tnode" << this << " -> node" << son << "[weight=100]\n";
+            son->dump(out);
         }
-        out << "\tnode" << this << " -> node" << m_parent << "[style=dashed]\n";
     }
 
   private:
-    Node *split_self(size_t begin, size_t end) {
-        keys_t node_keys(m_keys.begin() + begin, m_keys.begin() + end);
-        sons_t node_sons;
-        size_t node_counter = node_keys.size();
+    mapped_type *value_slot(size_t index) {
+        if constexpr (has_values) {
+            return &m_values[index];
+        } else {
+            return nullptr;
+        }
+    }
 
-        if (m_sons.size() == 2 * N) {
-            for (int i = 0; i < end - begin + 1; ++i) {
-                node_sons.push_back(m_sons[i + begin]);
-                node_counter += m_sons[i + begin]->count();
+    // keys, values and counters of other, sons are left to the caller
+    void copy_contents(const Node &other) {
+        std::copy_n(other.m_keys.begin(), other.m_size, m_keys.begin());
+        if constexpr (has_values) {
+            std::copy_n(other.m_values.begin(), other.m_size, m_values.begin());
+        }
+        std::copy_n(other.m_prefix.begin(), other.sons_count(), m_prefix.begin());
+        m_counter = other.m_counter;
+        m_aggregates = other.m_aggregates;
+        m_size = other.m_size;
+    }
+
+    // items [first, last) and, in internal nodes, the sons between them
+    aggregate_t combine_span(size_t first, size_t last) const {
+        aggregate_t result = Aggregate::identity();
+        for (size_t i = first; i < last; ++i) {
+            if (!m_leaf && i != first) {
+                result = Aggregate::combine(result, m_aggregates.sons[i]);
             }
+            result = Aggregate::combine(result, Aggregate::lift(item(i)));
         }
+        return result;
+    }
 
-        Node *new_node = new Node(std::move(node_keys), std::move(node_sons), node_counter);
+    // aggregate of subtree keys not less than begin
+    template <typename K>
+    aggregate_t suffix(const K &begin) const {
+        aggregate_t result = Aggregate::identity();
+        const Node *node = this;
+        while (true) {
+            BTREE_COUNT(nodes_visited, 1);
+            size_t index = node->lower_index(begin);
+            aggregate_t rest = node->combine_span(index, node->m_size);
+            if (!node->m_leaf && index != node->m_size) {
+                rest = Aggregate::combine(rest, node->m_aggregates.sons[node->m_size]);
+            }
+            result = Aggregate::combine(rest, result);
+            if (node->m_leaf || (index != node->m_size && !less(begin, node->m_keys[index]))) {
+                return result;
+            }
+            node = node->m_sons[index];
+        }
+    }
 
-        for (const auto &son : new_node->m_sons) {
-            son->m_parent = new_node;
+    // aggregate of subtree keys not greater than end
+    template <typename K>
+    aggregate_t prefix(const K &end) const {
+        aggregate_t result = Aggregate::identity();
+        const Node *node = this;
+        while (true) {
+            BTREE_COUNT(nodes_visited, 1);
+            size_t index = node->upper_index(end);
+            aggregate_t rest = node->combine_span(0, index);
+            if (!node->m_leaf && index != 0) {
+                rest = Aggregate::combine(node->m_aggregates.sons[0], rest);
+            }
+            result = Aggregate::combine(result, rest);
+            if (node->m_leaf || (index != 0 && !less(node->m_keys[index - 1], end))) {
+                return result;
+            }
+            node = node->m_sons[index];
         }
-        return new_node;
     }
 
-    // split son node
-    void split(size_t son_index) {
-        Node *son = m_sons[son_index];
-        m_keys.insert(m_keys.begin() + son_index, son->m_keys[N - 1]);
-        // create two nodes, delete old node
+    // rebuild total from items and son aggregates
+    void reaggregate() {
+        if constexpr (custom_aggregate) {
+            m_aggregates.total = combine_span(0, m_size);
+            if (!m_leaf) {
+                m_aggregates.total = Aggregate::combine(m_aggregates.sons[0], m_aggregates.total);
+                if (m_size != 0) {
+                    m_aggregates.total =
+                        Aggregate::combine(m_aggregates.total, m_aggregates.sons[m_size]);
+                }
+            }
+        }
+    }
 
-        Node *left = son->split_self(0, N - 1);
-        Node *right = son->split_self(N, 2 * N - 1);
+    // occurrences of key index, 1 outside of multisets
+    size_t weight(size_t index) const {
+        if constexpr (weighted) {
+            return m_values[index];
+        } else {
+            return 1;
+        }
+    }
 
-        right->m_parent = this;
-        left->m_parent = this;
+    // number of leaf keys before index
+    size_t leaf_rank(size_t index) const {
+        if constexpr (weighted) {
+            return std::accumulate(m_values.begin(), m_values.begin() + index, size_t{0});
+        } else {
+            return index;
+        }
+    }
 
-        m_sons[son_index] = left;
-        m_sons.push_back(right);
+    // number of subtree keys before son index
+    size_t son_offset(size_t index) const {
+        return index == 0 ? 0 : m_prefix[index - 1] + weight(index - 1);
+    }
 
-        son->m_sons.clear();
-        delete son;
+    // occurrences a multiset insert adds: its only argument
+    template <typename... Args>
+    static size_t added_keys(const Args &...args) {
+        if constexpr (weighted) {
+            return (static_cast<size_t>(args), ...);
+        } else {
+            return 1;
+        }
     }
-    Key max(const Node *node) {
-        while (!node->m_sons.empty()) {
-            node = node->m_sons.back();
+
+    // key is already present at index, multisets count the new occurrences
+    template <typename... Args>
+    InsertResult insert_found(size_t index, const Args &...args) {
+        if constexpr (weighted) {
+            add_weight(index, added_keys(args...));
         }
-        return node->m_keys.back();
+        return {this, index, weighted};
     }
 
-    Key min(const Node *node) {
-        while (!node->m_sons.empty()) {
+    // multiplicity of key index changed by delta, the node keeps its shape
+    void add_weight(size_t index, ptrdiff_t delta) {
+        m_values[index] += delta;
+        m_counter += delta;
+        if (!m_leaf) {
+            for (size_t i = index + 1; i <= m_size; ++i) {
+                m_prefix[i] += delta;
+            }
+        }
+    }
+
+    // node is about to be modified, a shared node is replaced by a private copy
+    template <typename Alloc>
+    static Node *own(Node *node, Alloc &alloc) {
+        if (!node->is_shared()) {
+            return node;
+        }
+        Node *copy = node->clone(alloc);
+        unref(alloc, node);
+        return copy;
+    }
+
+    template <typename Alloc>
+    Node *own_son(size_t index, Alloc &alloc) {
+        m_sons[index] = own(m_sons[index], alloc);
+        return m_sons[index];
+    }
+
+    // son index of internal node gained or lost keys
+    void update_count(size_t index, ptrdiff_t delta) {
+        m_counter += delta;
+        for (size_t i = index; i <= m_size; ++i) {
+            m_prefix[i] += delta;
+        }
+        if constexpr (custom_aggregate) {
+            m_aggregates.sons[index] = m_sons[index]->m_aggregates.total;
+            reaggregate();
+        }
+    }
+
+    // a key was replaced by its neighbour taken out of son index
+    void replaced_count(size_t son) {
+        if constexpr (weighted) {
+            // the key and its neighbour may occur a different number of times
+            recount();
+        } else {
+            update_count(son, -1);
+        }
+    }
+
+    // rebuild counters and aggregates after sons were moved in or out of the node
+    void recount() {
+        if (m_leaf) {
+            m_counter = leaf_rank(m_size);
+            reaggregate();
+            return;
+        }
+        size_t counter = 0;
+        for (size_t i = 0; i <= m_size; ++i) {
+            counter += m_sons[i]->m_counter;
+            m_prefix[i] = counter;
+            if (i < m_size) {
+                counter += weight(i);
+            }
+            if constexpr (custom_aggregate) {
+                m_aggregates.sons[i] = m_sons[i]->m_aggregates.total;
+            }
+        }
+        m_counter = m_prefix[m_size];
+        reaggregate();
+    }
+
+    // key's value changed in place, aggregates on the path to it are rebuilt
+    template <typename K>
+    void refresh(const K &key) {
+        size_t index = lower_index(key);
+        if (!m_leaf && (index == m_size || less(key, m_keys[index]))) {
+            m_sons[index]->refresh(key);
+            m_aggregates.sons[index] = m_sons[index]->m_aggregates.total;
+        }
+        reaggregate();
+    }
+
+    // free slot at index, keys (and values) from index on shift right
+    void open_slot(size_t index) {
+        std::move_backward(m_keys.begin() + index, m_keys.begin() + m_size,
+                           m_keys.begin() + m_size + 1);
+        if constexpr (has_values) {
+            std::move_backward(m_values.begin() + index, m_values.begin() + m_size,
+                               m_values.begin() + m_size + 1);
+        }
+        m_size += 1;
+    }
+
+    // slots [first, last) of source are moved to slots from index on
+    void move_slots(size_t index, Node *source, size_t first, size_t last) {
+        std::move(source->m_keys.begin() + first, source->m_keys.begin() + last,
+                  m_keys.begin() + index);
+        if constexpr (has_values) {
+            std::move(source->m_values.begin() + first, source->m_values.begin() + last,
+                      m_values.begin() + index);
+        }
+    }
+
+    template <typename K, typename... Args>
+    void insert_key(size_t index, K &&key, Args &&...args) {
+        open_slot(index);
+        m_keys[index] = std::forward<K>(key);
+        if constexpr (has_values) {
+            m_values[index] = mapped_type(std::forward<Args>(args)...);
+        }
+    }
+
+    void erase_key(size_t index) {
+        move_slots(index, this, index + 1, m_size);
+        m_size -= 1;
+    }
+
+    // must be called before insert_key, sons count is derived from m_size
+    void insert_son(size_t index, Node *son) {
+        std::move_backward(m_sons.begin() + index, m_sons.begin() + m_size + 1,
+                           m_sons.begin() + m_size + 2);
+        m_sons[index] = son;
+    }
+
+    // must be called before erase_key
+    void erase_son(size_t index) {
+        std::move(m_sons.begin() + index + 1, m_sons.begin() + m_size + 1, m_sons.begin() + index);
+    }
+
+    // split full son node, its upper half moves to the new right brother
+    template <typename Alloc>
+    void split(size_t son_index, Alloc &alloc) {
+        BTREE_COUNT(splits, 1);
+        Node *son = m_sons[son_index];
+        Node *right = create(alloc, son->m_leaf);
+
+        right->m_size = N - 1;
+        right->move_slots(0, son, N, max_keys);
+        if (!son->m_leaf) {
+            std::copy_n(son->m_sons.begin() + N, N, right->m_sons.begin());
+        }
+        son->m_size = N - 1;
+        son->recount();
+        right->recount();
+
+        insert_son(son_index + 1, right);
+        open_slot(son_index);
+        move_slots(son_index, son, N - 1, N);
+        recount();
+    }
+
+    static const Key &max(const Node *node) {
+        while (!node->m_leaf) {
+            node = node->m_sons[node->m_size];
+        }
+        return node->m_keys[node->m_size - 1];
+    }
+
+    static const Key &min(const Node *node) {
+        while (!node->m_leaf) {
             node = node->m_sons.front();
         }
         return node->m_keys.front();
     }
 
-    void delete_son(size_t index) {
-        m_sons[index]->m_sons.clear();
-        delete m_sons[index];
+    // move separator down to left son, first key of right son up to separator
+    void rotate_left(size_t index) {
+        BTREE_COUNT(rotations, 1);
+        Node *left = m_sons[index];
+        Node *right = m_sons[index + 1];
+
+        left->move_slots(left->m_size, this, index, index + 1);
+        move_slots(index, right, 0, 1);
+
+        if (!left->m_leaf) {
+            left->m_sons[left->m_size + 1] = right->m_sons.front();
+            right->erase_son(0);
+        }
+        left->m_size += 1;
+        right->erase_key(0);
+        left->recount();
+        right->recount();
+        recount();
     }
 
-    void erase_helper(size_t left, size_t right) {
-        Node *left_son = m_sons[left];
-        Node *right_son = m_sons[right];
+    // move separator down to right son, last key of left son up to separator
+    void rotate_right(size_t index) {
+        BTREE_COUNT(rotations, 1);
+        Node *left = m_sons[index];
+        Node *right = m_sons[index + 1];
 
-        left_son->m_keys.push_back(m_keys[left]);
-        left_son->m_counter += right_son->m_counter + 1;
+        if (!right->m_leaf) {
+            right->insert_son(0, left->m_sons[left->m_size]);
+        }
+        right->open_slot(0);
+        right->move_slots(0, this, index, index + 1);
+        move_slots(index, left, left->m_size - 1, left->m_size);
+        left->m_size -= 1;
+        left->recount();
+        right->recount();
+        recount();
+    }
 
-        left_son->m_keys.insert(left_son->m_keys.end(), right_son->m_keys.begin(),
-                                right_son->m_keys.end());
-        left_son->m_sons.insert(left_son->m_sons.end(), right_son->m_sons.begin(),
-                                right_son->m_sons.end());
+    // merge right son and separator into left son
+    template <typename Alloc>
+    void erase_helper(size_t left, size_t right, Alloc &alloc) {
+        BTREE_COUNT(merges, 1);
+        Node *left_son = own_son(left, alloc);
+        Node *right_son = own_son(right, alloc);
+
+        left_son->move_slots(left_son->m_size, this, left, left + 1);
+        left_son->move_slots(left_son->m_size + 1, right_son, 0, right_son->m_size);
+        if (!left_son->m_leaf) {
+            std::copy_n(right_son->m_sons.begin(), right_son->sons_count(),
+                        left_son->m_sons.begin() + left_son->m_size + 1);
+        }
+        left_son->m_size += right_son->m_size + 1;
+        left_son->recount();
 
-        delete_son(right);
+        destroy(alloc, right_son);
 
-        m_keys.erase(m_keys.begin() + left);
-        m_sons.erase(m_sons.begin() + right);
+        erase_son(right);
+        erase_key(left);
+        recount();
+    }
+
+    // sons left and left + 1 get at least N - 1 keys, they are merged if
+    // they fit in one node
+    template <typename Alloc>
+    void balance(size_t left, Alloc &alloc) {
+        Node *left_son = own_son(left, alloc);
+        Node *right_son = own_son(left + 1, alloc);
+        if (left_son->m_size >= N - 1 && right_son->m_size >= N - 1) {
+            recount();
+        } else if (left_son->m_size + right_son->m_size < max_keys) {
+            erase_helper(left, left + 1, alloc);
+        } else {
+            while (left_son->m_size < N - 1) {
+                rotate_left(left);
+            }
+            while (right_son->m_size < N - 1) {
+                rotate_right(left);
+            }
+        }
+    }
+
+    // Cut and join work on whole subtrees of known height, leaves have
+    // height 0 and an empty subtree has no root. A subtree passed to them
+    // is consumed, its root reference goes to the result
+    struct Piece {
+        Node *root;
+        size_t height;
+    };
+
+    // node of a cut subtree as a piece: recounted, or replaced by its only
+    // son if no keys are left
+    template <typename Alloc>
+    static Piece piece_of(Node *node, size_t height, Alloc &alloc) {
+        if (node->m_size != 0) {
+            node->recount();
+            return {node, height};
+        }
+        Node *son = node->m_leaf ? nullptr : node->m_sons[0];
+        destroy(alloc, node);
+        return {son, son ? height - 1 : 0};
+    }
+
+    // keys less than key (or not greater if upper) and the rest. Only nodes
+    // on the path to key are cut, pieces of each level are joined back
+    template <typename Alloc>
+    static std::pair<Piece, Piece> cut(Piece tree, const Key &key, bool upper, Alloc &alloc) {
+        if (!tree.root) {
+            return {tree, tree};
+        }
+        BTREE_COUNT(nodes_visited, 1);
+        Node *node = own(tree.root, alloc);
+        size_t index = upper ? node->upper_index(key) : node->lower_index(key);
+        Node *right = create(alloc, node->m_leaf);
+        right->move_slots(0, node, index, node->m_size);
+        right->m_size = node->m_size - index;
+        if (node->m_leaf) {
+            node->m_size = index;
+            return {piece_of(node, 0, alloc), piece_of(right, 0, alloc)};
+        }
+
+        // son index is cut, keys index - 1 and index join its pieces with
+        // the rest of the node; son 0 of right stands for the cut son
+        auto [left_piece, right_piece] =
+            cut({node->m_sons[index], tree.height - 1}, key, upper, alloc);
+        if (index != node->m_size) {
+            std::copy_n(node->m_sons.begin() + index + 1, right->m_size, right->m_sons.begin() + 1);
+            auto [separator, value] = right->take(0);
+            right->erase_son(0);
+            right->erase_key(0);
+            right_piece = join(right_piece, std::move(separator), std::move(value),
+                               piece_of(right, tree.height, alloc), alloc);
+        } else {
+            destroy(alloc, right);
+        }
+        if (index != 0) {
+            auto [separator, value] = node->take(index - 1);
+            node->m_size = index - 1;
+            left_piece = join(piece_of(node, tree.height, alloc), std::move(separator),
+                              std::move(value), left_piece, alloc);
+        } else {
+            destroy(alloc, node);
+        }
+        return {left_piece, right_piece};
+    }
+
+    // key and value of slot index are moved out, the slot stays in place
+    std::pair<Key, mapped_type> take(size_t index) {
+        if constexpr (has_values) {
+            return {std::move(m_keys[index]), std::move(m_values[index])};
+        } else {
+            return {std::move(m_keys[index]), NoValues{}};
+        }
+    }
+
+    // left, key and right, all keys of left less than key and key less than
+    // all keys of right. Costs O(N) per level of height difference
+    template <typename Alloc>
+    static Piece join(Piece left, Key &&key, mapped_type &&value, Piece right, Alloc &alloc) {
+        if (!left.root || !right.root) {
+            Piece tree = left.root ? left : right;
+            if (!tree.root) {
+                tree = {create(alloc, true), 0};
+            }
+            tree = prepare(tree, alloc);
+            tree.root->insert(std::move(key), alloc, nullptr, std::move(value));
+            return tree;
+        }
+        if (left.height == right.height) {
+            Node *root = create(alloc, false);
+            root->insert_key(0, std::move(key), std::move(value));
+            root->m_sons[0] = left.root;
+            root->m_sons[1] = right.root;
+            root->balance(0, alloc);
+            return piece_of(root, left.height + 1, alloc);
+        }
+        bool to_right = left.height > right.height;
+        Piece tree = prepare(to_right ? left : right, alloc);
+        tree.root->attach(tree.height, to_right ? right : left, std::move(key), std::move(value),
+                          to_right, alloc);
+        return tree;
+    }
+
+    // join without a separator, the first key of right becomes one
+    template <typename Alloc>
+    static Piece join(Piece left, Piece right, Alloc &alloc) {
+        if (!left.root || !right.root) {
+            return left.root ? left : right;
+        }
+        Node *root = own(right.root, alloc);
+        Key key = min(root);
+        mapped_type value{};
+        root->erase(key, alloc, &value);
+        return join(left, std::move(key), std::move(value), piece_of(root, right.height, alloc),
+                    alloc);
+    }
+
+    // private root of tree that can take one more key, the tree grows by a
+    // level if the root is full
+    template <typename Alloc>
+    static Piece prepare(Piece tree, Alloc &alloc) {
+        tree.root = own(tree.root, alloc);
+        if (!tree.root->is_full()) {
+            return tree;
+        }
+        Node *root = create(alloc, false);
+        root->m_sons[0] = tree.root;
+        root->split(0, alloc);
+        return {root, tree.height + 1};
+    }
+
+    // adds key and the lower subtree at the right (or left) end of this
+    // subtree of given height, full nodes on the way are split first
+    template <typename Alloc>
+    void attach(size_t height, Piece lower, Key &&key, mapped_type &&value, bool to_right,
+                Alloc &alloc) {
+        BTREE_COUNT(nodes_visited, 1);
+        if (height == lower.height + 1) {
+            if (to_right) {
+                insert_son(m_size + 1, lower.root);
+                insert_key(m_size, std::move(key), std::move(value));
+                balance(m_size - 1, alloc);
+            } else {
+                insert_son(0, lower.root);
+                insert_key(0, std::move(key), std::move(value));
+                balance(0, alloc);
+            }
+            return;
+        }
+        size_t index = to_right ? m_size : 0;
+        if (own_son(index, alloc)->is_full()) {
+            split(index, alloc);
+            index = to_right ? m_size : 0;
+        }
+        m_sons[index]->attach(height - 1, lower, std::move(key), std::move(value), to_right, alloc);
+        recount();
     }
 };
 
-template <typename CharT, typename Key, size_t N>
-std::basic_ostream<CharT> &operator<<(std::basic_ostream<CharT> &out, const Node<Key, N> &node) {
+template <typename CharT, typename Key, size_t N, typename Compare, typename Value>
+std::basic_ostream<CharT> &operator<<(std::basic_ostream<CharT> &out,
+                                      const Node<Key, N, Compare, Value> &node) {
     dump(node);
     return out;
 }
 
-template <typename Key, size_t N>
+// Keys are ordered by Compare, see Node. With a transparent Compare (such as
+// std::less<>) lookups accept any type comparable with Key, so a string tree
+// can be searched by std::string_view without building a std::string.
+// A non-void Value turns the set into a map, see BTreeMap, Multiplicity turns
+// it into a multiset, see BTreeMultiset. Aggregate is kept per subtree for
+// aggregate(begin, end), see Aggregates.hpp
+template <typename Key, size_t N, template <typename> typename Allocator = NodePool,
+          typename Compare = std::less<Key>, typename Value = void,
+          typename Aggregate = CountAggregate>
 class BTree final {
   private:
-    using node_p = Node<Key, N> *;
-    using value_type = Key;
+    using node_t = Node<Key, N, Compare, Value, Aggregate>;
+    using node_p = node_t *;
+    using value_type = typename node_t::value_type;
+    using allocator_t = Allocator<node_t>;
+    using mapped_type = typename node_t::mapped_type;
+
+    using aggregate_t = typename Aggregate::type;
 
+    static constexpr bool is_set = std::is_void_v<Value>;
+    static constexpr bool is_multiset = std::is_same_v<Value, Multiplicity>;
+    static constexpr bool is_map = !is_set && !is_multiset;
+    static constexpr bool custom_aggregate = node_t::custom_aggregate;
+
+    // shared with snapshots, whose nodes may outlive this tree
+    std::shared_ptr<allocator_t> m_alloc;
     node_p m_root = nullptr;
+    // descent of the last insert, checked link by link before it is reused
+    typename node_t::Path m_last_path;
 
-    node_p deep_copy(node_p other, node_p parent) {
-        node_p new_node = new Node<Key, N>(other->m_keys, {}, other->m_counter, parent);
+    template <typename K>
+    static constexpr bool lookup_key = transparent_compare<Compare> || std::is_same_v<K, Key>;
 
-        if (!other->m_sons.empty()) {
-            for (const node_p son : other->m_sons) {
-                new_node->m_sons.push_back(deep_copy(son, new_node));
-            }
+    // frees through allocator_t::defer, which any thread may call
+    struct SharedFree {
+        allocator_t &alloc;
+        void deallocate(node_p node) { alloc.defer(node); }
+    };
+
+    allocator_t &alloc() {
+        if (!m_alloc) {
+            m_alloc = std::make_shared<allocator_t>();
+        }
+        return *m_alloc;
+    }
+
+    node_p deep_copy(node_p other) {
+        if (!other) {
+            return nullptr;
+        }
+        node_p new_node = node_t::create(alloc(), other->m_leaf);
+        new_node->copy_contents(*other);
+
+        for (size_t i = 0; i < other->sons_count(); ++i) {
+            new_node->m_sons[i] = deep_copy(other->m_sons[i]);
         }
         return new_node;
     }
 
+    // bulk loaded level: items (keys of leaves, sons of internal nodes) are
+    // spread evenly over its nodes
+    struct BulkLevel {
+        size_t nodes;
+        size_t items;
+        size_t built = 0;
+
+        size_t next_size() {
+            size_t size = items / nodes + (built < items % nodes);
+            built += 1;
+            return size;
+        }
+    };
+
+    // takes key from sorted range and skips its duplicates
+    template <typename It>
+    static Key next_unique(It &first, It last) {
+        It current = first;
+        while (++first != last && !node_t::less(*current, *first)) {
+        }
+        return *current;
+    }
+
+    // nodes are completed in key order, leaves first
+    template <typename It>
+    node_p bulk_build(std::vector<BulkLevel> &levels, size_t level, It &first, It last) {
+        node_p node = node_t::create(alloc(), level == 0);
+        size_t size = levels[level].next_size();
+
+        if (level == 0) {
+            for (size_t i = 0; i < size; ++i) {
+                node->m_keys[i] = next_unique(first, last);
+            }
+            node->m_size = size;
+        } else {
+            for (size_t i = 0; i < size; ++i) {
+                node->m_sons[i] = bulk_build(levels, level - 1, first, last);
+                if (i + 1 < size) {
+                    node->m_keys[i] = next_unique(first, last);
+                }
+            }
+            node->m_size = size - 1;
+        }
+        node->recount();
+        return node;
+    }
+
   public:
+    using const_iterator = BTreeIterator<node_t>;
+    using iterator = const_iterator;
+    using allocator_type = allocator_t;
+
+    // map iterators yield pairs of references, which C++20 iterator concepts
+    // don't accept as a reference type
+    static_assert(is_map || std::bidirectional_iterator<const_iterator>);
+
     BTree() = default;
-    BTree(std::initializer_list<Key> list) : m_root(new Node<Key, N>) {
-        for (auto elem : list) {
-            insert(elem);
-        }
+    BTree(std::initializer_list<Key> list)
+        requires is_set
+    {
+        std::vector<Key> keys(list);
+        std::sort(keys.begin(), keys.end(), Compare{});
+        bulk_load(keys.begin(), keys.end());
+    }
+
+    // builds tree from sorted range, see bulk_load
+    template <std::forward_iterator It>
+        requires is_set
+    BTree(It first, It last, double fill = 1.0) {
+        bulk_load(first, last, fill);
     }
 
-    BTree(BTree<Key, N> &&other) : m_root(std::exchange(other.m_root, nullptr)) {}
+    BTree(BTree &&other)
+        : m_alloc(std::move(other.m_alloc)), m_root(std::exchange(other.m_root, nullptr)) {}
 
-    BTree(const BTree &other) : m_root(deep_copy(other.m_root, nullptr)) {}
+    // independent copy with its own allocator, see snapshot for a shared one
+    BTree(const BTree &other) : m_root(deep_copy(other.m_root)) {}
 
     BTree &operator=(const BTree &other) {
         if (this == std::addressof(other)) {
             return *this;
         }
         BTree temp(other);
-        std::swap(temp.m_root, m_root);
+        swap(temp);
 
         return *this;
     }
@@ -385,60 +1460,516 @@ class BTree final {
         if (this == std::addressof(other)) {
             return *this;
         }
-        BTree temp{other};
+        BTree temp{std::move(other)};
 
-        std::swap(m_root, temp.m_root);
+        swap(temp);
         return *this;
     }
 
-    ~BTree() { delete m_root; }
+    ~BTree() { clear(); }
 
-    bool insert(const Key &key) {
+    void swap(BTree &other) {
+        std::swap(m_alloc, other.m_alloc);
+        std::swap(m_root, other.m_root);
+    }
+
+    void clear() {
         if (!m_root) {
-            m_root = new Node<Key, N>({key}, {}, 1);
-            return true;
+            return;
         }
-        if (m_root->m_keys.size() == 2 * N - 1) {
-            node_p left_root = m_root->split_self(0, N - 1);
-            node_p right_root = m_root->split_self(N, 2 * N - 1);
-            node_p new_root =
-                new Node<Key, N>({m_root->m_keys[N - 1]}, {left_root, right_root}, m_root->count());
+        // an arena that owns every node can be dropped without visiting them,
+        // unless snapshots still refer to some of them
+        if constexpr (requires { m_alloc->release(); }) {
+            if (m_alloc.use_count() == 1) {
+                if constexpr (!std::is_trivially_destructible_v<node_t>) {
+                    node_t::destroy_subtree(*m_alloc, m_root);
+                }
+                m_alloc->release();
+                m_root = nullptr;
+                return;
+            }
+        }
+        // snapshots sharing the allocator may be dropped on other threads
+        // than the one that modifies the tree
+        if constexpr (requires(node_p node) { m_alloc->defer(node); }) {
+            if (m_alloc.use_count() > 1) {
+                SharedFree shared{*m_alloc};
+                node_t::unref(shared, m_root);
+                m_root = nullptr;
+                return;
+            }
+        }
+        node_t::unref(*m_alloc, m_root);
+        m_root = nullptr;
+    }
 
-            left_root->m_parent = new_root;
-            right_root->m_parent = new_root;
+    // read-only view of the current contents in O(1). Nodes are shared and
+    // the tree copies every node on a modified path that a snapshot still
+    // refers to, so the snapshot stays valid and unchanged. It may be read
+    // and destroyed concurrently with modifications of the tree: nodes it
+    // frees go back through the allocator's defer() if it has one. Modifying
+    // it allocates from the allocator of the tree, so only do that on the
+    // thread that modifies the tree
+    BTree snapshot() const {
+        BTree result;
+        if (m_root) {
+            m_root->m_refs.fetch_add(1, std::memory_order_relaxed);
+            result.m_alloc = m_alloc;
+            result.m_root = m_root;
+        }
+        return result;
+    }
 
-            m_root->m_sons.clear();
-            delete m_root;
+    // replaces contents with keys of sorted range [first, last), duplicates are
+    // skipped. Nodes are packed bottom-up to fill share of their capacity, but
+    // never below N - 1 keys.
+    template <std::forward_iterator It>
+        requires is_set
+    void bulk_load(It first, It last, double fill = 1.0) {
+        clear();
+        size_t count = 0;
+        for (It it = first; it != last; next_unique(it, last)) {
+            count += 1;
+        }
+        if (count == 0) {
+            return;
+        }
 
-            m_root = new_root;
+        size_t node_keys = std::clamp<size_t>(std::lround(fill * (2 * N - 1)), N - 1, 2 * N - 1);
+        auto level_nodes = [node_keys](size_t items) {
+            size_t packed = (items + node_keys) / (node_keys + 1);
+            return std::max<size_t>(1, std::min(packed, items / N));
+        };
+
+        // every leaf but the last is followed by a separator in upper levels
+        std::vector<BulkLevel> levels;
+        size_t leaves = level_nodes(count + 1);
+        levels.push_back({leaves, count - (leaves - 1)});
+        while (levels.back().nodes > 1) {
+            size_t sons = levels.back().nodes;
+            levels.push_back({level_nodes(sons), sons});
+        }
+        m_root = bulk_build(levels, levels.size() - 1, first, last);
+    }
+
+    bool insert(const Key &key)
+        requires is_set
+    {
+        return insert_key(key).inserted;
+    }
+
+    // key is moved into its leaf, splits and merges move keys as well
+    bool insert(Key &&key)
+        requires is_set
+    {
+        return insert_key(std::move(key)).inserted;
+    }
+
+    // std::set style insert near hint, returns the position of key. Nodes
+    // have no parent pointers, so the hint can't lead back up the tree;
+    // instead every insert continues from the descent of the previous one,
+    // which is where the usual hints (end() or the last result) point
+    iterator insert(const_iterator, const Key &key)
+        requires is_set
+    {
+        auto result = insert_key(key);
+        return const_iterator(m_root, result.node, result.index);
+    }
+    iterator insert(const_iterator, Key &&key)
+        requires is_set
+    {
+        auto result = insert_key(std::move(key));
+        return const_iterator(m_root, result.node, result.index);
+    }
+
+    // inserts Key(args...), the key is built even if it is already present
+    template <typename... Args>
+        requires is_set
+    bool emplace(Args &&...args) {
+        return insert(Key(std::forward<Args>(args)...));
+    }
+
+    // map: inserts key with Value(args...) unless key is present, the value
+    // is not built then
+    template <typename... Args>
+        requires is_map
+    std::pair<iterator, bool> try_emplace(const Key &key, Args &&...args) {
+        auto result = insert_key(key, std::forward<Args>(args)...);
+        return {const_iterator(m_root, result.node, result.index), result.inserted};
+    }
+    template <typename... Args>
+        requires is_map
+    std::pair<iterator, bool> try_emplace(Key &&key, Args &&...args) {
+        auto result = insert_key(std::move(key), std::forward<Args>(args)...);
+        return {const_iterator(m_root, result.node, result.index), result.inserted};
+    }
+
+    // map: value of key, a default one is inserted if key is absent. The
+    // reference is valid until the next modification or snapshot of the map.
+    // Aggregates can't follow writes through it, use insert_or_assign then
+    mapped_type &operator[](const Key &key)
+        requires(is_map && !custom_aggregate)
+    {
+        auto result = insert_key(key);
+        return result.node->m_values[result.index];
+    }
+    mapped_type &operator[](Key &&key)
+        requires(is_map && !custom_aggregate)
+    {
+        auto result = insert_key(std::move(key));
+        return result.node->m_values[result.index];
+    }
+
+    // map: sets value of key, returns true if key was inserted
+    template <typename V>
+        requires is_map
+    bool insert_or_assign(const Key &key, V &&value) {
+        // value is consumed only if the key is inserted
+        auto result = insert_key(key, std::forward<V>(value));
+        if (!result.inserted) {
+            result.node->m_values[result.index] = std::forward<V>(value);
+            if constexpr (custom_aggregate) {
+                m_root->refresh(key);
+            }
         }
-        return m_root->insert(key);
+        return result.inserted;
+    }
+
+    // inserts keys in any order, returns number of keys that were not present.
+    // The batch is sorted first, so upper levels are visited once per run of
+    // neighbouring keys instead of once per key
+    size_t insert_batch(std::span<const Key> keys)
+        requires is_set
+    {
+        BTREE_COUNT(operations, 1);
+        std::vector<Key> sorted(keys.begin(), keys.end());
+        std::sort(sorted.begin(), sorted.end(), Compare{});
+        auto equal = [](const Key &lhs, const Key &rhs) { return !node_t::less(lhs, rhs); };
+        sorted.erase(std::unique(sorted.begin(), sorted.end(), equal), sorted.end());
+
+        size_t inserted = 0;
+        std::span<const Key> rest(sorted);
+        while (!rest.empty()) {
+            prepare_root();
+            rest = rest.subspan(m_root->insert_batch(rest, alloc(), inserted));
+        }
+        return inserted;
+    }
+
+    // multiset: adds count occurrences of key, returns its multiplicity
+    size_t insert(const Key &key, size_t count = 1)
+        requires is_multiset
+    {
+        if (count == 0) {
+            return this->count(key);
+        }
+        auto result = insert_key(key, count);
+        return result.node->m_values[result.index];
+    }
+    size_t insert(Key &&key, size_t count = 1)
+        requires is_multiset
+    {
+        if (count == 0) {
+            return this->count(key);
+        }
+        auto result = insert_key(std::move(key), count);
+        return result.node->m_values[result.index];
+    }
+
+    bool erase(const Key &key)
+        requires(!is_multiset)
+    {
+        return remove(key, 1) != 0;
     }
 
-    bool erase(const Key &key) {
+    // removes keys in [begin, end], the ones distance(begin, end) counts,
+    // and returns their number. Subtrees inside the range are freed whole,
+    // only nodes on the paths to begin and end are cut and joined back, so
+    // it takes O(log n) plus the number of freed nodes
+    size_t erase_range(const Key &begin, const Key &end) {
+        BTREE_COUNT(operations, 1);
+        if (!m_root || !node_t::less(begin, end)) {
+            return 0;
+        }
+        size_t count = size();
+        auto [left, rest] = node_t::cut({m_root, height()}, begin, false, alloc());
+        auto [middle, right] = node_t::cut(rest, end, true, alloc());
+        if (middle.root) {
+            node_t::unref(alloc(), middle.root);
+        }
+        m_root = node_t::join(left, right, alloc()).root;
+        return count - size();
+    }
+
+    // moves keys not less than key to the returned tree in O(log n): nodes
+    // on the path to key are cut, the pieces of each level are joined to
+    // the trees. The trees share the allocator, see snapshot
+    BTree split(const Key &key) {
+        BTREE_COUNT(operations, 1);
+        BTree result;
         if (!m_root) {
-            return false;
+            return result;
         }
-        if (m_root->m_keys.size() == 1 && m_root->m_keys.front() == key) {
-            m_root->erase_helper(0, 1);
-            node_p old_root = m_root;
-            m_root = m_root->m_sons.front();
-            old_root->m_sons.pop_back();
-            delete old_root;
+        auto [left, right] = node_t::cut({m_root, height()}, key, false, alloc());
+        m_root = left.root;
+        if (right.root) {
+            result.m_alloc = m_alloc;
+            result.m_root = right.root;
         }
-        return m_root->erase(key);
+        return result;
     }
 
-    size_t distance(const Key &begin, const Key &end) const {
-        if (end <= begin) {
+    // appends keys of right, which must all be greater than the keys of
+    // this tree, or std::invalid_argument is thrown. The shorter tree is
+    // attached to the spine of the taller one in O(log n). Nodes of another
+    // NodePool are taken over with the pool unless snapshots still use it,
+    // then they are copied
+    void join(BTree &&right) {
+        BTREE_COUNT(operations, 1);
+        if (!right.m_root) {
+            return;
+        }
+        if (!m_root) {
+            swap(right);
+            return;
+        }
+        if (!node_t::less(node_t::max(m_root), node_t::min(right.m_root))) {
+            throw std::invalid_argument("BTree::join: keys of right must be greater");
+        }
+        if (m_alloc != right.m_alloc && !std::is_empty_v<allocator_t>) {
+            bool merged = false;
+            if constexpr (requires { m_alloc->merge(*right.m_alloc); }) {
+                if (right.m_alloc.use_count() == 1) {
+                    m_alloc->merge(*right.m_alloc);
+                    merged = true;
+                }
+            }
+            if (!merged) {
+                node_p copy = deep_copy(right.m_root);
+                right.clear();
+                right.m_root = copy;
+            }
+        }
+        size_t right_height = right.height();
+        node_p right_root = std::exchange(right.m_root, nullptr);
+        m_root = node_t::join({m_root, height()}, {right_root, right_height}, alloc()).root;
+    }
+
+    // multiset: removes every occurrence of key, returns their number
+    size_t erase(const Key &key)
+        requires is_multiset
+    {
+        return remove(key, SIZE_MAX);
+    }
+
+    // multiset: removes one occurrence of key
+    bool erase_one(const Key &key)
+        requires is_multiset
+    {
+        return remove(key, 1) != 0;
+    }
+
+    // number of occurrences of key, 0 or 1 unless this is a multiset
+    template <typename K>
+        requires lookup_key<K>
+    size_t count(const K &key) const {
+        BTREE_COUNT(operations, 1);
+        return m_root ? m_root->occurrences(key) : 0;
+    }
+    size_t count(const Key &key) const { return count<Key>(key); }
+
+    template <typename K>
+        requires lookup_key<K>
+    size_t distance(const K &begin, const K &end) const {
+        BTREE_COUNT(operations, 1);
+        if (!m_root || !node_t::less(begin, end)) {
             return 0;
         }
         return m_root->distance(begin, end);
     }
+    size_t distance(const Key &begin, const Key &end) const { return distance<Key>(begin, end); }
+
+    // Aggregate of keys in [begin, end] in O(N log n), identity if end <= begin;
+    // equals distance for CountAggregate
+    template <typename K>
+        requires lookup_key<K>
+    aggregate_t aggregate(const K &begin, const K &end) const {
+        BTREE_COUNT(operations, 1);
+        if (!m_root || !node_t::less(begin, end)) {
+            return Aggregate::identity();
+        }
+        return m_root->aggregate(begin, end);
+    }
+    aggregate_t aggregate(const Key &begin, const Key &end) const {
+        return aggregate<Key>(begin, end);
+    }
+
+    // aggregate of all keys in O(1)
+    aggregate_t aggregate() const { return m_root ? m_root->total() : Aggregate::identity(); }
+
+    // out[i] = distance(ranges[i].first, ranges[i].second); range bounds are
+    // sorted together and answered in one shared traversal
+    void distance_batch(std::span<const std::pair<Key, Key>> ranges, std::span<size_t> out) const {
+        BTREE_COUNT(operations, 1);
+        std::vector<size_t> ranks(2 * ranges.size());
+        std::vector<typename node_t::RankProbe> probes;
+        probes.reserve(2 * ranges.size());
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            probes.push_back({ranges[i].first, false, &ranks[2 * i]});
+            probes.push_back({ranges[i].second, true, &ranks[2 * i + 1]});
+        }
+        std::sort(probes.begin(), probes.end(),
+                  [](const auto &lhs, const auto &rhs) { return node_t::less(lhs.key, rhs.key); });
+        if (m_root) {
+            m_root->rank_batch(probes);
+        }
+
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            bool empty = !m_root || !node_t::less(ranges[i].first, ranges[i].second);
+            out[i] = empty ? 0 : ranks[2 * i + 1] - ranks[2 * i];
+        }
+    }
+
+    // out[i] = distance(ranges[i].first, ranges[i].second). Unlike
+    // distance_batch nothing is sorted: the descents of several ranges run
+    // interleaved and prefetch their next nodes, which pays off for
+    // scattered ranges over trees larger than the cache
+    void distance_many(std::span<const std::pair<Key, Key>> ranges, std::span<size_t> out) const {
+        BTREE_COUNT(operations, 1);
+        std::vector<size_t> ranks(2 * ranges.size());
+        std::vector<typename node_t::RankProbe> probes;
+        probes.reserve(2 * ranges.size());
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            probes.push_back({ranges[i].first, false, &ranks[2 * i]});
+            probes.push_back({ranges[i].second, true, &ranks[2 * i + 1]});
+        }
+        if (m_root) {
+            m_root->rank_interleaved(probes);
+        }
+
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            bool empty = !m_root || !node_t::less(ranges[i].first, ranges[i].second);
+            out[i] = empty ? 0 : ranks[2 * i + 1] - ranks[2 * i];
+        }
+    }
+
+    // out[i] = find(keys[i]), the descents run interleaved like in distance_many
+    void find_many(std::span<const Key> keys, std::span<const_iterator> out) const {
+        BTREE_COUNT(operations, 1);
+        if (!m_root) {
+            std::fill_n(out.begin(), keys.size(), cend());
+            return;
+        }
+        std::vector<typename node_t::FindProbe> probes(keys.size());
+        for (size_t i = 0; i < keys.size(); ++i) {
+            probes[i] = {&keys[i], &out[i]};
+        }
+        m_root->find_interleaved(probes);
+
+        for (size_t i = 0; i < keys.size(); ++i) {
+            if (out[i] == const_iterator()) {
+                out[i] = cend();
+            }
+        }
+    }
+
+    // shape and memory of the tree, visits every node. Operation counters
+    // are kept separately, see operation_counters
+    TreeStats stats() const {
+        TreeStats result;
+        std::vector<const node_t *> level;
+        if (m_root) {
+            level.push_back(m_root);
+        }
+        while (!level.empty()) {
+            std::vector<const node_t *> next;
+            size_t keys = 0;
+            for (const node_t *node : level) {
+                keys += node->m_size;
+                next.insert(next.end(), node->sons().begin(), node->sons().end());
+            }
+            result.height += 1;
+            result.nodes += level.size();
+            result.keys += keys;
+            result.fill.push_back(static_cast<double>(keys) / (level.size() * (2 * N - 1)));
+            level = std::move(next);
+        }
+        result.key_bytes = result.nodes * sizeof(node_t::m_keys);
+        result.son_bytes = result.nodes * sizeof(node_t::m_sons);
+        result.value_bytes = is_set ? 0 : result.nodes * sizeof(node_t::m_values);
+        result.node_bytes = result.nodes * sizeof(node_t);
+        return result;
+    }
+
+    // immutable copy of the keys for read-mostly use, queries on it don't
+    // chase pointers, see FrozenBTree. Later changes of the tree don't reach it
+    FrozenBTree<Key, Compare> freeze() const {
+        std::vector<Key> keys;
+        std::vector<size_t> counts;
+        collect(m_root, keys, counts);
+        return FrozenBTree<Key, Compare>(keys, counts);
+    }
+
+    // writes an image that MappedBTree<Key, N> maps without rebuilding the
+    // tree, throws std::runtime_error if the file can't be written
+    void save(const std::string &path) const
+        requires is_set
+    {
+        static_assert(std::is_trivially_copyable_v<Key>, "saved keys must be trivially copyable");
+        static_assert(std::is_same_v<typename node_t::search_t, NodeSearch<Key>>,
+                      "MappedBTree searches images with operator<");
+        using image_t = ImageNode<Key, N>;
+
+        std::vector<const node_t *> order;
+        if (m_root) {
+            order.push_back(m_root);
+        }
+        for (size_t i = 0; i < order.size(); ++i) {
+            order.insert(order.end(), order[i]->sons().begin(), order[i]->sons().end());
+        }
+
+        std::ofstream out(path, std::ios::binary | std::ios::trunc);
+        std::vector<char> page(image_page_size);
+        ImageHeader header{ImageHeader::magic_value,
+                           ImageHeader::format_version,
+                           sizeof(Key),
+                           N,
+                           sizeof(image_t),
+                           order.size(),
+                           size()};
+        std::memcpy(page.data(), &header, sizeof(header));
+        out.write(page.data(), page.size());
+        std::fill(page.begin(), page.end(), 0);
+
+        // sons of a node are consecutive in breadth-first order
+        const ImageLayout layout{sizeof(image_t)};
+        size_t written = 0;
+        size_t next = 1;
+        for (size_t i = 0; i < order.size(); ++i) {
+            const node_t *node = order[i];
+            size_t offset = layout.offset(i);
+            out.write(page.data(), offset - written);
+            written = offset + sizeof(image_t);
+
+            image_t image{};
+            std::copy_n(node->m_keys.begin(), node->m_size, image.m_keys.begin());
+            std::copy_n(node->m_prefix.begin(), node->sons_count(), image.m_prefix.begin());
+            for (size_t j = 0; j < node->sons_count(); ++j, ++next) {
+                image.m_sons[j] = static_cast<int64_t>(layout.offset(next) - offset);
+            }
+            image.m_counter = node->m_counter;
+            image.m_size = node->m_size;
+            image.m_leaf = node->m_leaf;
+            out.write(reinterpret_cast<const char *>(&image), sizeof(image));
+        }
+        if (!out.flush()) {
+            throw std::runtime_error(path + ": can't write BTree image");
+        }
+    }
 
     template <typename CharT>
     friend std::basic_ostream<CharT> &operator<<(std::basic_ostream<CharT> &out,
-                                                 const BTree<Key, N> &tree) {
+                                                 const BTree &tree) {
         out << "digraph G {\n";
         if (tree.m_root) {
             tree.m_root->dump(out);
@@ -450,102 +1981,184 @@ class BTree final {
     }
 
   private:
-    struct base_iterator {
-      public:
-        using iterator_category = std::bidirectional_iterator_tag;
-        using difference_type = std::ptrdiff_t;
-        using value_type = BTree::value_type;
-        using const_pointer = const value_type *;
-        using const_reference = const value_type &;
-        using const_node_pointer = const Node<Key, N> *;
-
-      private:
-        const_node_pointer node;
-        ssize_t position;
-
-      public:
-        base_iterator(const_node_pointer node, ssize_t pos) : node(node), position(pos) {}
-        base_iterator() : node(nullptr), position(0) {}
-
-        const_reference operator*() const { return node->m_keys[position]; }
-        const_pointer operator->() const { return &node->m_keys[position]; }
-        base_iterator &operator++() {
-            position += 1;
-            if (position < node->m_sons.size() || position < node->m_keys.size()) {
-                while (!node->m_sons.empty()) {
-                    node = node->m_sons[position];
-                    position = 0;
-                }
-                return *this;
-            }
-            position = node->m_keys.size();
-            while (position == node->m_keys.size() && node->m_parent) {
-                // TODO rewrite to std::upper_bound
-#if 0
-                auto temp = node->keys[position];
-                node = node->parent;
-                position = 
-                    std::lower_bound(node->keys.begin(), node->keys.end(), temp) -
-                    node->keys.begin()
-#else
-                auto temp = node;
-                node = node->m_parent;
-                position = std::find(node->m_sons.begin(), node->m_sons.end(), temp) -
-                           node->m_sons.begin();
-#endif
-            }
+    // nearly sorted keys continue the descent of the previous insert kept in
+    // m_last_path instead of searching from the root
+    template <typename K, typename... Args>
+    typename node_t::InsertResult insert_key(K &&key, Args &&...args) {
+        BTREE_COUNT(operations, 1);
+        prepare_root();
+        return node_t::insert_along(m_root, m_last_path, std::forward<K>(key), alloc(),
+                                    std::forward<Args>(args)...);
+    }
 
-            return *this;
+    // erases up to limit occurrences of key, returns number of erased ones
+    size_t remove(const Key &key, size_t limit) {
+        BTREE_COUNT(operations, 1);
+        if (!m_root) {
+            return 0;
         }
-        base_iterator operator++(int) {
-            base_iterator temp = *this;
-            ++(*this);
-            return temp;
+        own_root();
+        size_t removed = m_root->erase(key, alloc(), nullptr, limit);
+        if (m_root->m_size == 0) {
+            node_p old_root = m_root;
+            m_root = m_root->m_leaf ? nullptr : m_root->m_sons.front();
+            node_t::destroy(alloc(), old_root);
         }
+        return removed;
+    }
 
-        // TODO implement
-        base_iterator &operator--() {}
-
-        base_iterator operator--(int) {
-            base_iterator temp = *this;
-            --(*this);
-            return temp;
-        };
+    // root is about to be modified, copy it if a snapshot shares it
+    void own_root() { m_root = node_t::own(m_root, alloc()); }
 
-        friend bool operator==(const base_iterator &lhs, const base_iterator &rhs) {
-            return (lhs.node == rhs.node) && (lhs.position == rhs.position);
+    // distinct keys of subtree in order, with multiplicities for multisets
+    static void collect(const node_t *node, std::vector<Key> &keys, std::vector<size_t> &counts) {
+        if (!node) {
+            return;
         }
-        friend bool operator!=(const base_iterator &lhs, const base_iterator &rhs) {
-            return !(lhs == rhs);
+        for (size_t i = 0; i <= node->m_size; ++i) {
+            if (!node->m_leaf) {
+                collect(node->m_sons[i], keys, counts);
+            }
+            if (i != node->m_size) {
+                keys.push_back(node->m_keys[i]);
+                if constexpr (is_multiset) {
+                    counts.push_back(node->m_values[i]);
+                }
+            }
         }
-    };
+    }
 
-    static_assert(std::bidirectional_iterator<base_iterator>);
+    // levels below the root
+    size_t height() const {
+        size_t height = 0;
+        for (const node_t *node = m_root; node && !node->m_leaf; node = node->m_sons[0]) {
+            height += 1;
+        }
+        return height;
+    }
 
-  public:
-    using const_iterator = base_iterator;
-    using iterator = base_iterator;
+    // creates root or grows tree by one level, so root can take a key
+    void prepare_root() {
+        if (!m_root) {
+            m_root = node_t::create(alloc(), true);
+        }
+        own_root();
+        if (m_root->is_full()) {
+            node_p new_root = node_t::create(alloc(), false);
+            new_root->m_sons[0] = m_root;
+            m_root = new_root;
+            m_root->split(0, alloc());
+        }
+    }
 
-    const_iterator find(const Key &key) const {
+  public:
+    template <typename K>
+        requires lookup_key<K>
+    const_iterator find(const K &key) const {
+        BTREE_COUNT(operations, 1);
+        if (!m_root) {
+            return cend();
+        }
         auto result = m_root->find(key);
         return (result == const_iterator() ? cend() : result);
     }
+    const_iterator find(const Key &key) const { return find<Key>(key); }
+
+    size_t size() const { return m_root ? m_root->count() : 0; }
+    bool empty() const { return !m_root; }
+
+    // number of keys less than key, multiset keys count every occurrence
+    template <typename K>
+        requires lookup_key<K>
+    size_t rank(const K &key) const {
+        BTREE_COUNT(operations, 1);
+        return m_root ? m_root->rank(key) : 0;
+    }
+    size_t rank(const Key &key) const { return rank<Key>(key); }
 
-    iterator find(const Key &key) { return std::as_const(*this).find(key); }
+    // iterator to the k-th smallest key (from zero), end() if k >= size()
+    const_iterator select(size_t k) const {
+        BTREE_COUNT(operations, 1);
+        if (k >= size()) {
+            return cend();
+        }
+        auto [node, index, occurrence] = m_root->select(k);
+        return const_iterator(m_root, node, index, occurrence);
+    }
+
+    // iterator to the nearest-rank q-quantile, q in [0, 1]
+    const_iterator quantile(double q) const {
+        if (empty()) {
+            return cend();
+        }
+        q = std::clamp(q, 0.0, 1.0);
+        return select(static_cast<size_t>(q * (size() - 1) + 0.5));
+    }
 
     const_iterator cbegin() const {
         node_p begin = m_root;
         if (begin) {
-            while (begin->m_sons.size()) {
+            while (!begin->m_leaf) {
                 begin = begin->m_sons.front();
             }
         }
-        return const_iterator(begin, 0);
+        return const_iterator(m_root, begin, 0);
     }
     const_iterator cend() const {
-        return (m_root ? const_iterator(m_root, m_root->m_keys.size()) : const_iterator());
+        return (m_root ? const_iterator(m_root, m_root, m_root->m_size) : const_iterator());
     }
 
     iterator begin() { return std::as_const(*this).cbegin(); }
     iterator end() { return std::as_const(*this).cend(); }
+    const_iterator begin() const { return cbegin(); }
+    const_iterator end() const { return cend(); }
+
+    template <typename K>
+        requires lookup_key<K>
+    const_iterator lower_bound(const K &key) const {
+        BTREE_COUNT(operations, 1);
+        if (!m_root) {
+            return cend();
+        }
+        auto result = m_root->bound(key, false);
+        return (result == const_iterator() ? cend() : result);
+    }
+    const_iterator lower_bound(const Key &key) const { return lower_bound<Key>(key); }
+
+    template <typename K>
+        requires lookup_key<K>
+    const_iterator upper_bound(const K &key) const {
+        BTREE_COUNT(operations, 1);
+        if (!m_root) {
+            return cend();
+        }
+        auto result = m_root->bound(key, true);
+        return (result == const_iterator() ? cend() : result);
+    }
+    const_iterator upper_bound(const Key &key) const { return upper_bound<Key>(key); }
+
+    template <typename K>
+        requires lookup_key<K>
+    std::pair<const_iterator, const_iterator> equal_range(const K &key) const {
+        return {lower_bound(key), upper_bound(key)};
+    }
+    std::pair<const_iterator, const_iterator> equal_range(const Key &key) const {
+        return {lower_bound(key), upper_bound(key)};
+    }
 };
+
+// Ordered map over the same nodes: values live next to the keys of a node in
+// their own array, so searches read only keys. Iterators yield
+// std::pair<const Key &, const Value &>, values are changed through
+// operator[] or try_emplace, which copy nodes shared with snapshots first
+template <typename Key, typename Value, size_t N, template <typename> typename Allocator = NodePool,
+          typename Compare = std::less<Key>, typename Aggregate = CountAggregate>
+using BTreeMap = BTree<Key, N, Allocator, Compare, Value, Aggregate>;
+
+// Ordered multiset that stores every distinct key once with the number of
+// its occurrences, so memory grows with distinct keys. size, rank, distance,
+// select and iteration count every occurrence; erase removes all occurrences
+// of a key, erase_one a single one
+template <typename Key, size_t N, template <typename> typename Allocator = NodePool,
+          typename Compare = std::less<Key>>
+using BTreeMultiset = BTree<Key, N, Allocator, Compare, Multiplicity>;
@@ -0,0 +1,875 @@
+#pragma once
+
+#include "NodePool.hpp"
+#include "NodeSearch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstdint>
+#include <iterator>
+#include <memory>
+#include <span>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+template <typename Key, size_t N, template <typename> typename Allocator>
+class BufferedBTree;
+
+// B-epsilon tree node: keys and separators as in BPlusNode (son i holds keys
+// k with keys[i - 1] <= k < keys[i]), and internal nodes buffer pending
+// insert and erase messages for their subtree, sorted by key. A message is
+// newer than any message for the same key below it. Writes are blind, so a
+// message carries the change of the count it is assumed to make: +1 for an
+// insert and -1 for an erase, or the exact change once it has replaced an
+// older message for its key. Counters of an internal node include the
+// deltas of its own buffer; a delta that was wrong is corrected when the
+// message reaches its leaf, and the correction goes up the flush path.
+template <typename Key, size_t N>
+struct alignas(64) BufferedNode final {
+  private:
+    static_assert(N >= 2, "BufferedBTree degree must be at least 2");
+
+    static constexpr size_t max_keys = 2 * N - 1;
+    static constexpr size_t max_sons = 2 * N;
+    // a longer buffer is flushed; its largest group, at least four messages,
+    // goes down to one son at once
+    static constexpr size_t max_messages = 4 * max_sons;
+
+    using keys_t = std::array<Key, NodeSearch<Key>::capacity(max_keys)>;
+    using sons_t = std::array<BufferedNode *, max_sons>;
+    using prefix_t = std::array<size_t, max_sons>;
+
+    struct Message {
+        Key key;
+        bool insert;  // erase otherwise
+        int8_t delta; // assumed change of the count, see above
+    };
+
+    template <typename, size_t, template <typename> typename>
+    friend class BufferedBTree;
+
+    keys_t m_keys;
+    sons_t m_sons;
+    prefix_t m_prefix;               // internal nodes: number of keys in sons[0..i]
+    std::vector<Message> m_messages; // internal nodes only
+    size_t m_counter = 0;            // keys of subtree, pending messages included
+    uint32_t m_size = 0;             // number of keys in node
+    bool m_leaf = true;
+    // a son could not be flushed or split while this node was full, and
+    // waits for it to be split; see drain
+    bool m_stuck = false;
+
+    static bool key_less(const Message &message, const Key &key) { return message.key < key; }
+    static bool less_key(const Key &key, const Message &message) { return key < message.key; }
+    static ptrdiff_t delta(const Message &message) { return message.delta; }
+
+    // newer replaces older for the same key: the state before older is
+    // assumed as before, the state after is known
+    static Message combine(const Message &older, const Message &newer) {
+        return {newer.key, newer.insert,
+                static_cast<int8_t>(older.delta + newer.insert - older.insert)};
+    }
+
+  public:
+    using value_type = Key;
+
+    explicit BufferedNode(bool leaf) : m_leaf(leaf) {}
+    BufferedNode(const BufferedNode &) = delete;
+    BufferedNode(BufferedNode &&) = delete;
+
+    BufferedNode &operator=(const BufferedNode &rhs) = delete;
+    BufferedNode &operator=(BufferedNode &&rhs) = delete;
+
+    ~BufferedNode() = default;
+
+    template <typename Alloc>
+    static BufferedNode *create(Alloc &alloc, bool leaf) {
+        return ::new (static_cast<void *>(alloc.allocate())) BufferedNode(leaf);
+    }
+
+    template <typename Alloc>
+    static void destroy(Alloc &alloc, BufferedNode *node) {
+        node->~BufferedNode();
+        alloc.deallocate(node);
+    }
+
+    template <typename Alloc>
+    static void destroy_subtree(Alloc &alloc, BufferedNode *node) {
+        for (BufferedNode *son : node->sons()) {
+            destroy_subtree(alloc, son);
+        }
+        destroy(alloc, node);
+    }
+
+    size_t size() const { return m_size; }
+    size_t sons_count() const { return m_leaf ? 0 : m_size + 1; }
+    size_t count() const { return m_counter; }
+    bool is_full() const { return m_size == max_keys; }
+    bool is_underfull() const { return m_size < N - 1; }
+
+    std::span<BufferedNode *const> sons() const { return {m_sons.data(), sons_count()}; }
+
+    size_t lower_index(const Key &key) const {
+        return NodeSearch<Key>::lower_index(m_keys.data(), m_size, key);
+    }
+    size_t upper_index(const Key &key) const {
+        return NodeSearch<Key>::upper_index(m_keys.data(), m_size, key);
+    }
+
+    // the newest message for key decides, keys without one are in the leaf
+    bool contains(const Key &key) const {
+        const BufferedNode *node = this;
+        while (!node->m_leaf) {
+            auto it = std::lower_bound(node->m_messages.begin(), node->m_messages.end(), key,
+                                       key_less);
+            if (it != node->m_messages.end() && it->key == key) {
+                return it->insert;
+            }
+            node = node->m_sons[node->upper_index(key)];
+        }
+        size_t index = node->lower_index(key);
+        return index != node->m_size && node->m_keys[index] == key;
+    }
+
+    // number of keys in subtree less than key, or not greater if upper:
+    // counters of the sons passed by plus the messages for keys between the
+    // son taken and key. Wrong deltas still pending may make it negative
+    ptrdiff_t rank(const Key &key, bool upper = false) const {
+        ptrdiff_t counter = 0;
+        const BufferedNode *node = this;
+        while (!node->m_leaf) {
+            size_t index = node->upper_index(key);
+            const auto &messages = node->m_messages;
+            auto first = messages.begin();
+            if (index != 0) {
+                counter += node->m_prefix[index - 1];
+                first = std::lower_bound(first, messages.end(), node->m_keys[index - 1], key_less);
+            }
+            auto last = upper ? std::upper_bound(first, messages.end(), key, less_key)
+                              : std::lower_bound(first, messages.end(), key, key_less);
+            for (; first != last; ++first) {
+                counter += delta(*first);
+            }
+            node = node->m_sons[index];
+        }
+        return counter + (upper ? node->upper_index(key) : node->lower_index(key));
+    }
+
+    // Keys of the leaf key leads to (the first leaf for null key) with the
+    // messages for its range on the path merged in, deepest buffer first as
+    // it is the oldest. upper is set to the separator above the range, null
+    // for the last leaf
+    void leaf_keys(const Key *key, std::vector<Key> &keys, const Key *&upper) const {
+        const Key *lower = nullptr;
+        upper = nullptr;
+        std::vector<const BufferedNode *> path;
+        const BufferedNode *node = this;
+        while (!node->m_leaf) {
+            path.push_back(node);
+            size_t index = key ? node->upper_index(*key) : 0;
+            lower = index == 0 ? lower : &node->m_keys[index - 1];
+            upper = index == node->m_size ? upper : &node->m_keys[index];
+            node = node->m_sons[index];
+        }
+        keys.assign(node->m_keys.begin(), node->m_keys.begin() + node->m_size);
+        std::vector<Key> merged;
+        for (auto it = path.rbegin(); it != path.rend(); ++it) {
+            const auto &messages = (*it)->m_messages;
+            auto first = messages.begin();
+            auto last = messages.end();
+            if (lower) {
+                first = std::lower_bound(first, last, *lower, key_less);
+            }
+            if (upper) {
+                last = std::lower_bound(first, last, *upper, key_less);
+            }
+            if (first == last) {
+                continue;
+            }
+            merged.clear();
+            auto current = keys.begin();
+            for (; first != last; ++first) {
+                for (; current != keys.end() && *current < first->key; ++current) {
+                    merged.push_back(*current);
+                }
+                if (current != keys.end() && *current == first->key) {
+                    ++current;
+                }
+                if (first->insert) {
+                    merged.push_back(first->key);
+                }
+            }
+            merged.insert(merged.end(), current, keys.end());
+            keys.swap(merged);
+        }
+    }
+
+    // leaf: applies message, which may find the set as it wants it already;
+    // a leaf without room for the key must be split first
+    void apply(const Message &message) {
+        size_t index = lower_index(message.key);
+        bool found = index != m_size && m_keys[index] == message.key;
+        if (message.insert && !found) {
+            insert_key(index, message.key);
+        } else if (!message.insert && found) {
+            erase_key(index);
+        }
+        m_counter = m_size;
+    }
+
+    // internal node: message replaces an older one for the same key
+    void add_message(const Message &message) {
+        auto it = std::lower_bound(m_messages.begin(), m_messages.end(), message.key, key_less);
+        ptrdiff_t change = delta(message);
+        if (it != m_messages.end() && it->key == message.key) {
+            Message combined = combine(*it, message);
+            change = delta(combined) - delta(*it);
+            *it = combined;
+        } else {
+            m_messages.insert(it, message);
+        }
+        update_count(upper_index(message.key), change);
+    }
+
+    // internal node: merges a sorted batch of newer messages into the
+    // buffer, a message replaces an older one for the same key
+    void add_messages(const Message *first, const Message *last) {
+        std::vector<Message> merged;
+        merged.reserve(m_messages.size() + (last - first));
+        auto it = m_messages.begin();
+        size_t son = 0;
+        ptrdiff_t change = 0; // of the counter by messages so far
+        for (; first != last; ++first) {
+            for (; it != m_messages.end() && it->key < first->key; ++it) {
+                merged.push_back(*it);
+            }
+            for (; son < m_size && !(first->key < m_keys[son]); ++son) {
+                m_prefix[son] += change;
+            }
+            if (it != m_messages.end() && it->key == first->key) {
+                Message combined = combine(*it, *first);
+                change += delta(combined) - delta(*it++);
+                merged.push_back(combined);
+            } else {
+                change += delta(*first);
+                merged.push_back(*first);
+            }
+        }
+        merged.insert(merged.end(), it, m_messages.end());
+        m_messages.swap(merged);
+        for (; son <= m_size; ++son) {
+            m_prefix[son] += change;
+        }
+        m_counter += change;
+    }
+
+    // Moves the largest group of messages bound for one son down to it. The
+    // son's own buffer is flushed in turn while it is too long, and sons that
+    // overflow or underflow are split, rotated or merged here. Returns false
+    // if that needs a split while this node is full: the caller splits it and
+    // flushes again. A stuck node drains its waiting son first
+    template <typename Alloc>
+    bool flush(Alloc &alloc) {
+        if (m_stuck) {
+            for (size_t i = 0; i <= m_size; ++i) {
+                if (m_sons[i]->waiting()) {
+                    return drain(i, alloc);
+                }
+            }
+            m_stuck = false;
+        }
+        size_t best = 0;
+        size_t first = 0;
+        size_t last = 0;
+        size_t begin = 0;
+        for (size_t i = 0; i <= m_size; ++i) {
+            size_t end = i == m_size ? m_messages.size()
+                                     : std::lower_bound(m_messages.begin() + begin,
+                                                        m_messages.end(), m_keys[i], key_less) -
+                                           m_messages.begin();
+            if (end - begin > last - first) {
+                best = i;
+                first = begin;
+                last = end;
+            }
+            begin = end;
+        }
+        if (m_sons[best]->m_leaf) {
+            return deliver(first, last, alloc);
+        }
+        // the son counts the messages from now on, with the deltas of
+        // those that replace older ones corrected
+        BufferedNode *son = m_sons[best];
+        ptrdiff_t change = -static_cast<ptrdiff_t>(son->m_counter);
+        for (size_t i = first; i < last; ++i) {
+            change -= delta(m_messages[i]);
+        }
+        son->add_messages(m_messages.data() + first, m_messages.data() + last);
+        m_messages.erase(m_messages.begin() + first, m_messages.begin() + last);
+        update_count(best, change + son->m_counter);
+        return drain(best, alloc);
+    }
+
+    // Applies every message for keys in [begin, end] (null bounds are open)
+    // to the leaves. Returns false as flush does; the messages already
+    // applied stay applied
+    template <typename Alloc>
+    bool flush_range(const Key *begin, const Key *end, Alloc &alloc) {
+        if (m_leaf) {
+            return true;
+        }
+        size_t first =
+            begin ? std::lower_bound(m_messages.begin(), m_messages.end(), *begin, key_less) -
+                        m_messages.begin()
+                  : 0;
+        size_t last =
+            end ? std::upper_bound(m_messages.begin(), m_messages.end(), *end, less_key) -
+                      m_messages.begin()
+                : m_messages.size();
+        if (m_sons[0]->m_leaf) {
+            return deliver(first, last, alloc);
+        }
+        for (size_t i = first; i < last;) {
+            size_t index = upper_index(m_messages[i].key);
+            size_t next = index == m_size ? last
+                                           : std::lower_bound(m_messages.begin() + i,
+                                                              m_messages.begin() + last,
+                                                              m_keys[index], key_less) -
+                                                 m_messages.begin();
+            m_sons[index]->add_messages(m_messages.data() + i, m_messages.data() + next);
+            i = next;
+        }
+        m_messages.erase(m_messages.begin() + first, m_messages.begin() + last);
+
+        size_t index = begin ? upper_index(*begin) : 0;
+        while (true) {
+            if (!m_sons[index]->flush_range(begin, end, alloc)) {
+                if (is_full()) {
+                    recount();
+                    return false;
+                }
+                split(index, alloc);
+                continue;
+            }
+            // a merge may bring in a brother that still has messages in range
+            if (m_sons[index]->is_underfull() && m_size != 0) {
+                index = rebalance(index, alloc);
+                continue;
+            }
+            if (index == m_size || (end && *end < m_keys[index])) {
+                break;
+            }
+            index += 1;
+        }
+        recount();
+        return true;
+    }
+
+  private:
+    // applies messages [first, last) to leaf sons and drops them from the
+    // buffer; stops when a full leaf has to be split while this node is full.
+    // The delta a message was counted with is replaced by the change it
+    // makes. A split or rebalance recounts this node with applied messages
+    // still in the buffer, so it is recounted again once they are dropped
+    template <typename Alloc>
+    bool deliver(size_t first, size_t last, Alloc &alloc) {
+        bool restructured = false;
+        size_t done = first;
+        for (; done < last; ++done) {
+            const Message &message = m_messages[done];
+            size_t index = upper_index(message.key);
+            BufferedNode *son = m_sons[index];
+            if (message.insert && son->is_full() && !son->contains(message.key)) {
+                if (is_full()) {
+                    break;
+                }
+                split(index, alloc);
+                restructured = true;
+                index = upper_index(message.key);
+                son = m_sons[index];
+            }
+            ptrdiff_t change = -static_cast<ptrdiff_t>(son->m_size) - delta(message);
+            son->apply(message);
+            update_count(index, change + son->m_size);
+            // a node merged down to one son leaves it underfull until the
+            // parent rebalances the node itself
+            if (son->is_underfull() && m_size != 0) {
+                rebalance(index, alloc);
+                restructured = true;
+            }
+        }
+        m_messages.erase(m_messages.begin() + first, m_messages.begin() + done);
+        if (restructured) {
+            recount();
+        }
+        return done == last;
+    }
+
+    // internal node whose buffer is too long or that is stuck
+    bool waiting() const { return !m_leaf && (m_messages.size() > max_messages || m_stuck); }
+
+    // Flushes son index until its buffer fits, splitting it when it is full.
+    // A full son that fails to flush is split and flushed again; if this node
+    // is full too, it gets stuck and fails in turn, so the root grows and the
+    // retry comes down the same path
+    template <typename Alloc>
+    bool drain(size_t index, Alloc &alloc) {
+        while (true) {
+            BufferedNode *son = m_sons[index];
+            if (!son->waiting()) {
+                break;
+            }
+            if (son->is_full()) {
+                if (is_full()) {
+                    m_stuck = true;
+                    return false;
+                }
+                split(index, alloc);
+                if (!drain(index + 1, alloc)) {
+                    return false;
+                }
+                continue;
+            }
+            ptrdiff_t change = -static_cast<ptrdiff_t>(son->m_counter);
+            son->flush(alloc);
+            update_count(index, change + son->m_counter);
+            if (son->is_underfull() && m_size != 0) {
+                index = rebalance(index, alloc);
+            }
+        }
+        return true;
+    }
+
+    void update_count(size_t index, ptrdiff_t delta) {
+        m_counter += delta;
+        for (size_t i = index; i <= m_size; ++i) {
+            m_prefix[i] += delta;
+        }
+    }
+
+    void recount() {
+        if (m_leaf) {
+            m_counter = m_size;
+            return;
+        }
+        ptrdiff_t counter = 0;
+        auto it = m_messages.begin();
+        for (size_t i = 0; i <= m_size; ++i) {
+            counter += m_sons[i]->m_counter;
+            for (; it != m_messages.end() && (i == m_size || it->key < m_keys[i]); ++it) {
+                counter += delta(*it);
+            }
+            m_prefix[i] = counter;
+        }
+        m_counter = counter;
+    }
+
+    void insert_key(size_t index, const Key &key) {
+        std::move_backward(m_keys.begin() + index, m_keys.begin() + m_size,
+                           m_keys.begin() + m_size + 1);
+        m_keys[index] = key;
+        m_size += 1;
+    }
+
+    void erase_key(size_t index) {
+        std::move(m_keys.begin() + index + 1, m_keys.begin() + m_size, m_keys.begin() + index);
+        m_size -= 1;
+    }
+
+    // must be called before insert_key
+    void insert_son(size_t index, BufferedNode *son) {
+        std::move_backward(m_sons.begin() + index, m_sons.begin() + m_size + 1,
+                           m_sons.begin() + m_size + 2);
+        m_sons[index] = son;
+    }
+
+    // must be called before erase_key
+    void erase_son(size_t index) {
+        std::move(m_sons.begin() + index + 1, m_sons.begin() + m_size + 1, m_sons.begin() + index);
+    }
+
+    // full leaf keeps N - 1 keys and the first key of its new right brother is
+    // copied up; full internal node moves its middle separator up and the
+    // messages from it on to the brother
+    template <typename Alloc>
+    void split(size_t son_index, Alloc &alloc) {
+        BufferedNode *son = m_sons[son_index];
+        BufferedNode *right = create(alloc, son->m_leaf);
+
+        if (son->m_leaf) {
+            right->m_size = N;
+            std::copy(son->m_keys.begin() + N - 1, son->m_keys.begin() + max_keys,
+                      right->m_keys.begin());
+        } else {
+            right->m_size = N - 1;
+            std::copy(son->m_keys.begin() + N, son->m_keys.begin() + max_keys,
+                      right->m_keys.begin());
+            std::copy(son->m_sons.begin() + N, son->m_sons.end(), right->m_sons.begin());
+            auto middle = std::lower_bound(son->m_messages.begin(), son->m_messages.end(),
+                                           son->m_keys[N - 1], key_less);
+            right->m_messages.assign(middle, son->m_messages.end());
+            son->m_messages.erase(middle, son->m_messages.end());
+            right->m_stuck = son->m_stuck;
+        }
+        son->m_size = N - 1;
+        son->recount();
+        right->recount();
+
+        insert_son(son_index + 1, right);
+        insert_key(son_index, son->m_leaf ? right->m_keys.front() : son->m_keys[N - 1]);
+        recount();
+    }
+
+    // underfull son index borrows from a brother or is merged with one.
+    // Returns index of the son that holds its keys now
+    template <typename Alloc>
+    size_t rebalance(size_t index, Alloc &alloc) {
+        if (index < m_size && m_sons[index + 1]->m_size > N - 1) {
+            rotate_left(index);
+        } else if (index > 0 && m_sons[index - 1]->m_size > N - 1) {
+            rotate_right(index - 1);
+        } else if (index < m_size) {
+            merge(index, alloc);
+        } else {
+            merge(index - 1, alloc);
+            index -= 1;
+        }
+        return index;
+    }
+
+    // move first key (and son with its messages) of right son to left son
+    void rotate_left(size_t index) {
+        BufferedNode *left = m_sons[index];
+        BufferedNode *right = m_sons[index + 1];
+
+        if (left->m_leaf) {
+            left->m_keys[left->m_size] = right->m_keys.front();
+            right->erase_key(0);
+            m_keys[index] = right->m_keys.front();
+        } else {
+            left->m_keys[left->m_size] = m_keys[index];
+            left->m_sons[left->m_size + 1] = right->m_sons.front();
+            m_keys[index] = right->m_keys.front();
+            right->erase_son(0);
+            right->erase_key(0);
+            auto moved = std::lower_bound(right->m_messages.begin(), right->m_messages.end(),
+                                          m_keys[index], key_less);
+            left->m_messages.insert(left->m_messages.end(), right->m_messages.begin(), moved);
+            right->m_messages.erase(right->m_messages.begin(), moved);
+            left->m_stuck = right->m_stuck = left->m_stuck || right->m_stuck;
+        }
+        left->m_size += 1;
+        left->recount();
+        right->recount();
+        recount();
+    }
+
+    // move last key (and son with its messages) of left son to right son
+    void rotate_right(size_t index) {
+        BufferedNode *left = m_sons[index];
+        BufferedNode *right = m_sons[index + 1];
+
+        if (left->m_leaf) {
+            right->insert_key(0, left->m_keys[left->m_size - 1]);
+            m_keys[index] = right->m_keys.front();
+        } else {
+            right->insert_son(0, left->m_sons[left->m_size]);
+            right->insert_key(0, m_keys[index]);
+            m_keys[index] = left->m_keys[left->m_size - 1];
+            auto moved = std::lower_bound(left->m_messages.begin(), left->m_messages.end(),
+                                          m_keys[index], key_less);
+            right->m_messages.insert(right->m_messages.begin(), moved, left->m_messages.end());
+            left->m_messages.erase(moved, left->m_messages.end());
+            left->m_stuck = right->m_stuck = left->m_stuck || right->m_stuck;
+        }
+        left->m_size -= 1;
+        left->recount();
+        right->recount();
+        recount();
+    }
+
+    // merge son index + 1 into son index, buffers are concatenated
+    template <typename Alloc>
+    void merge(size_t index, Alloc &alloc) {
+        BufferedNode *left = m_sons[index];
+        BufferedNode *right = m_sons[index + 1];
+
+        if (left->m_leaf) {
+            std::copy(right->m_keys.begin(), right->m_keys.begin() + right->m_size,
+                      left->m_keys.begin() + left->m_size);
+            left->m_size += right->m_size;
+        } else {
+            left->m_keys[left->m_size] = m_keys[index];
+            std::copy(right->m_keys.begin(), right->m_keys.begin() + right->m_size,
+                      left->m_keys.begin() + left->m_size + 1);
+            std::copy(right->m_sons.begin(), right->m_sons.begin() + right->m_size + 1,
+                      left->m_sons.begin() + left->m_size + 1);
+            left->m_size += right->m_size + 1;
+            left->m_messages.insert(left->m_messages.end(), right->m_messages.begin(),
+                                    right->m_messages.end());
+            left->m_stuck = left->m_stuck || right->m_stuck;
+        }
+        left->recount();
+        destroy(alloc, right);
+
+        erase_son(index + 1);
+        erase_key(index);
+        recount();
+    }
+};
+
+// Forward iterator over the keys with all pending messages applied. The
+// keys of one leaf merged with the messages for its range form a chunk,
+// the next chunk is built from the separator above the leaf. Copies share
+// the chunk. Writes invalidate iterators
+template <typename NodeT>
+class BufferedIterator final {
+  public:
+    using iterator_category = std::forward_iterator_tag;
+    using difference_type = std::ptrdiff_t;
+    using value_type = typename NodeT::value_type;
+    using const_pointer = const value_type *;
+    using const_reference = const value_type &;
+    using const_node_pointer = const NodeT *;
+
+  private:
+    const_node_pointer root; // null at the end
+    std::shared_ptr<const std::vector<value_type>> chunk;
+    size_t position = 0;
+    const value_type *upper = nullptr; // keys of later chunks are not less
+
+    // chunk of the leaf key leads to, or of the first leaf after it with
+    // keys left
+    void load(const value_type *key) {
+        auto keys = std::make_shared<std::vector<value_type>>();
+        while (true) {
+            root->leaf_keys(key, *keys, upper);
+            position = 0;
+            if (!keys->empty()) {
+                chunk = std::move(keys);
+                return;
+            }
+            if (!upper) {
+                root = nullptr;
+                return;
+            }
+            key = upper;
+        }
+    }
+
+  public:
+    // first key not less than key, the first key for null key
+    BufferedIterator(const_node_pointer root, const value_type *key) : root(root) {
+        if (root) {
+            load(key);
+        }
+        if (key && this->root) {
+            position = std::lower_bound(chunk->begin(), chunk->end(), *key) - chunk->begin();
+            if (position == chunk->size()) {
+                position -= 1;
+                ++(*this);
+            }
+        }
+    }
+    BufferedIterator() : root(nullptr) {}
+
+    const_reference operator*() const { return (*chunk)[position]; }
+    const_pointer operator->() const { return &(*chunk)[position]; }
+
+    BufferedIterator &operator++() {
+        position += 1;
+        if (position == chunk->size()) {
+            if (upper) {
+                load(upper);
+            } else {
+                root = nullptr;
+                chunk = nullptr;
+                position = 0;
+            }
+        }
+        return *this;
+    }
+    BufferedIterator operator++(int) {
+        BufferedIterator temp = *this;
+        ++(*this);
+        return temp;
+    }
+
+    friend bool operator==(const BufferedIterator &lhs, const BufferedIterator &rhs) {
+        return (lhs.root == rhs.root) && (!lhs.root || *lhs == *rhs);
+    }
+    friend bool operator!=(const BufferedIterator &lhs, const BufferedIterator &rhs) {
+        return !(lhs == rhs);
+    }
+};
+
+// Write-optimized set: inserts and erases are messages that wait in the
+// buffers of internal nodes and move down in batches, so a write changes
+// the root buffer and a share of the batch flushes instead of a whole path.
+// Writes are blind: they don't read their key, so they don't report
+// whether the set changed. Reads don't flush: contains takes the newest
+// message on the way down and iterators merge the buffers on the path into
+// the keys of each leaf, both exact. rank and distance add up the deltas
+// of the buffers they pass and size is the root counter; these count a
+// pending insert of a present key or erase of a missing one as a change
+// until it reaches its leaf, and are exact after flush().
+template <typename Key, size_t N, template <typename> typename Allocator = NodePool>
+class BufferedBTree final {
+  private:
+    using node_t = BufferedNode<Key, N>;
+    using node_p = node_t *;
+    using message_t = typename node_t::Message;
+    using value_type = Key;
+    using allocator_t = Allocator<node_t>;
+
+    allocator_t m_alloc;
+    node_p m_root = nullptr;
+
+    void put(const message_t &message) {
+        if (!m_root) {
+            m_root = node_t::create(m_alloc, true);
+        }
+        // small trees are a single leaf without a buffer
+        if (m_root->m_leaf && !(message.insert && m_root->is_full())) {
+            m_root->apply(message);
+            return;
+        }
+        if (m_root->m_leaf) {
+            grow();
+        }
+        m_root->add_message(message);
+        while (m_root->waiting()) {
+            if (!m_root->flush(m_alloc)) {
+                grow();
+            }
+        }
+        shrink();
+    }
+
+    // full root gets a new parent and is split
+    void grow() {
+        node_p new_root = node_t::create(m_alloc, false);
+        new_root->m_sons[0] = m_root;
+        new_root->m_stuck = m_root->m_stuck;
+        m_root = new_root;
+        m_root->split(0, m_alloc);
+    }
+
+    // root left with one son hands its messages down and goes away; a leaf
+    // son can only take them once the buffer is flushed
+    void shrink() {
+        while (!m_root->m_leaf && m_root->m_size == 0) {
+            node_p son = m_root->m_sons[0];
+            if (son->m_leaf && !m_root->m_messages.empty()) {
+                return;
+            }
+            son->add_messages(m_root->m_messages.data(),
+                              m_root->m_messages.data() + m_root->m_messages.size());
+            node_t::destroy(m_alloc, m_root);
+            m_root = son;
+        }
+    }
+
+    // counts below zero come from wrong deltas of erases still pending
+    static size_t clamp(ptrdiff_t count) { return count < 0 ? 0 : count; }
+
+    void flush_range(const Key *begin, const Key *end) {
+        if (!m_root) {
+            return;
+        }
+        while (!m_root->flush_range(begin, end, m_alloc)) {
+            grow();
+        }
+        shrink();
+    }
+
+  public:
+    BufferedBTree() = default;
+    BufferedBTree(std::initializer_list<Key> list) {
+        for (const Key &key : list) {
+            insert(key);
+        }
+    }
+
+    BufferedBTree(BufferedBTree &&other)
+        : m_alloc(std::move(other.m_alloc)), m_root(std::exchange(other.m_root, nullptr)) {}
+
+    BufferedBTree(const BufferedBTree &) = delete;
+    BufferedBTree &operator=(const BufferedBTree &) = delete;
+
+    BufferedBTree &operator=(BufferedBTree &&other) {
+        if (this == std::addressof(other)) {
+            return *this;
+        }
+        BufferedBTree temp{std::move(other)};
+        swap(temp);
+        return *this;
+    }
+
+    ~BufferedBTree() { clear(); }
+
+    void swap(BufferedBTree &other) {
+        std::swap(m_alloc, other.m_alloc);
+        std::swap(m_root, other.m_root);
+    }
+
+    void clear() {
+        if (!m_root) {
+            return;
+        }
+        // nodes own their buffers, so they are destroyed one by one
+        node_t::destroy_subtree(m_alloc, m_root);
+        if constexpr (requires { m_alloc.release(); }) {
+            m_alloc.release();
+        }
+        m_root = nullptr;
+    }
+
+    void insert(const Key &key) { put({key, true, 1}); }
+    void erase(const Key &key) { put({key, false, -1}); }
+
+    bool contains(const Key &key) const { return m_root && m_root->contains(key); }
+
+    // applies all pending messages
+    void flush() { flush_range(nullptr, nullptr); }
+
+    size_t size() const { return m_root ? clamp(m_root->count()) : 0; }
+    bool empty() const { return size() == 0; }
+
+    // number of keys less than key
+    size_t rank(const Key &key) const { return m_root ? clamp(m_root->rank(key)) : 0; }
+
+    size_t distance(const Key &begin, const Key &end) const {
+        if (!m_root || !(begin < end)) {
+            return 0;
+        }
+        return clamp(m_root->rank(end, true) - m_root->rank(begin));
+    }
+
+    using const_iterator = BufferedIterator<node_t>;
+    using iterator = const_iterator;
+
+    static_assert(std::forward_iterator<const_iterator>);
+
+    const_iterator cbegin() const { return const_iterator(m_root, nullptr); }
+    const_iterator cend() const { return const_iterator(); }
+
+    iterator begin() const { return cbegin(); }
+    iterator end() const { return cend(); }
+
+    const_iterator lower_bound(const Key &key) const { return const_iterator(m_root, &key); }
+
+    const_iterator find(const Key &key) const {
+        auto it = lower_bound(key);
+        return (it == cend() || *it != key) ? cend() : it;
+    }
+
+    // calls func for every key in [begin, end] in order
+    template <typename Func>
+    void for_each_in(const Key &begin, const Key &end, Func func) const {
+        for (auto it = lower_bound(begin); it != cend() && !(end < *it); ++it) {
+            func(*it);
+        }
+    }
+};
@@ -0,0 +1,413 @@
+#pragma once
+
+#include "NodePool.hpp"
+#include "NodeSearch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <atomic>
+#include <cstdint>
+#include <thread>
+#include <type_traits>
+#include <utility>
+
+#if defined(__SSE2__)
+    #include <immintrin.h>
+#endif
+
+template <typename Key, size_t N, template <typename> typename Allocator>
+class ConcurrentBTree;
+
+// B+tree node guarded by an optimistic version latch.
+// Version word: bit 1 is the write lock, the rest is a counter bumped on
+// every write unlock. Readers never write shared memory: they remember the
+// version, read the node and validate that the version has not changed.
+template <typename Key, size_t N>
+struct alignas(64) ConcurrentNode final {
+  private:
+    static_assert(N >= 2, "ConcurrentBTree degree must be at least 2");
+    // readers may copy keys that are being overwritten and discard them later
+    static_assert(std::is_trivially_copyable_v<Key>, "optimistic readers need trivial keys");
+
+    static constexpr size_t max_keys = 2 * N - 1;
+    static constexpr size_t max_sons = 2 * N;
+    static constexpr uint64_t locked_bit = 0b10;
+
+    using keys_t = std::array<Key, NodeSearch<Key>::capacity(max_keys)>;
+    using sons_t = std::array<ConcurrentNode *, max_sons>;
+
+    template <typename, size_t, template <typename> typename>
+    friend class ConcurrentBTree;
+
+    std::atomic<uint64_t> m_version{0b100};
+    std::atomic<uint32_t> m_size{0}; // number of keys in node
+    bool m_leaf = true;
+    std::atomic<ConcurrentNode *> m_next{nullptr}; // leaves only
+    keys_t m_keys;
+    sons_t m_sons;
+
+  public:
+    explicit ConcurrentNode(bool leaf) : m_leaf(leaf) {}
+    ConcurrentNode(const ConcurrentNode &) = delete;
+    ConcurrentNode &operator=(const ConcurrentNode &rhs) = delete;
+
+    template <typename Alloc>
+    static ConcurrentNode *create(Alloc &alloc, bool leaf) {
+        return ::new (static_cast<void *>(alloc.allocate())) ConcurrentNode(leaf);
+    }
+
+    template <typename Alloc>
+    static void destroy_subtree(Alloc &alloc, ConcurrentNode *node) {
+        if (!node->m_leaf) {
+            for (size_t i = 0; i <= node->size(); ++i) {
+                destroy_subtree(alloc, node->m_sons[i]);
+            }
+        }
+        node->~ConcurrentNode();
+        alloc.deallocate(node);
+    }
+
+    size_t size() const { return m_size.load(std::memory_order_relaxed); }
+    bool is_full() const { return size() == max_keys; }
+
+    size_t lower_index(const Key &key) const {
+        return NodeSearch<Key>::lower_index(m_keys.data(), size(), key);
+    }
+    size_t upper_index(const Key &key) const {
+        return NodeSearch<Key>::upper_index(m_keys.data(), size(), key);
+    }
+
+  private:
+    uint64_t read_lock(bool &restart) const {
+        uint64_t version = m_version.load(std::memory_order_acquire);
+        if (version & locked_bit) {
+#if defined(__SSE2__)
+            _mm_pause();
+#endif
+            restart = true;
+        }
+        return version;
+    }
+
+    void check(uint64_t version, bool &restart) const {
+        std::atomic_thread_fence(std::memory_order_acquire);
+        restart = version != m_version.load(std::memory_order_relaxed);
+    }
+
+    void upgrade(uint64_t &version, bool &restart) {
+        if (m_version.compare_exchange_strong(version, version + locked_bit,
+                                              std::memory_order_acquire)) {
+            version += locked_bit;
+        } else {
+            restart = true;
+        }
+    }
+
+    void write_unlock() { m_version.fetch_add(locked_bit, std::memory_order_release); }
+
+    void insert_key(size_t index, const Key &key) {
+        size_t size = this->size();
+        std::move_backward(m_keys.begin() + index, m_keys.begin() + size,
+                           m_keys.begin() + size + 1);
+        m_keys[index] = key;
+    }
+
+    // must be called before insert_key, sons count is derived from m_size
+    void insert_son(size_t index, ConcurrentNode *son) {
+        size_t size = this->size();
+        std::move_backward(m_sons.begin() + index, m_sons.begin() + size + 1,
+                           m_sons.begin() + size + 2);
+        m_sons[index] = son;
+    }
+
+    // upper half of a locked node moves to a new right brother, returns the
+    // separator; a leaf keeps N - 1 keys and its separator is copied up
+    template <typename Alloc>
+    ConcurrentNode *split(Alloc &alloc, Key &separator) {
+        ConcurrentNode *right = create(alloc, m_leaf);
+        if (m_leaf) {
+            std::copy(m_keys.begin() + N - 1, m_keys.begin() + max_keys, right->m_keys.begin());
+            right->m_size.store(N, std::memory_order_relaxed);
+            right->m_next.store(m_next.load(std::memory_order_relaxed), std::memory_order_relaxed);
+            m_next.store(right, std::memory_order_release);
+            separator = right->m_keys.front();
+        } else {
+            std::copy(m_keys.begin() + N, m_keys.begin() + max_keys, right->m_keys.begin());
+            std::copy(m_sons.begin() + N, m_sons.end(), right->m_sons.begin());
+            right->m_size.store(N - 1, std::memory_order_relaxed);
+            separator = m_keys[N - 1];
+        }
+        m_size.store(N - 1, std::memory_order_relaxed);
+        return right;
+    }
+};
+
+// Thread-safe B+tree with optimistic lock coupling.
+//
+// find and distance are lock-free reads that restart when a node they passed
+// changes under them. insert and erase descend optimistically as well and
+// write-lock only the leaf they modify, plus the parent when a full node is
+// split on the way down. Erase does not rebalance, so nodes are never freed
+// while the tree is alive and readers can't touch reclaimed memory.
+//
+// Unlike BTree there are no subtree counters: every writer would have to
+// update the root, which would serialize them again. distance walks the leaf
+// chain instead and costs O(log n + k / N) for k keys in range.
+//
+// The allocator policy is shared by all threads and must be thread-safe,
+// so the default is HeapAllocator rather than NodePool.
+template <typename Key, size_t N, template <typename> typename Allocator = HeapAllocator>
+class ConcurrentBTree final {
+  private:
+    using node_t = ConcurrentNode<Key, N>;
+    using node_p = node_t *;
+    using allocator_t = Allocator<node_t>;
+
+    allocator_t m_alloc;
+    std::atomic<node_p> m_root;
+
+    static void backoff(size_t attempt) {
+        if (attempt > 8) {
+            std::this_thread::yield();
+        }
+    }
+
+    // reads root and its version, fails if root was replaced meanwhile
+    node_p lock_root(uint64_t &version, bool &restart) const {
+        node_p node = m_root.load(std::memory_order_acquire);
+        version = node->read_lock(restart);
+        if (!restart && node != m_root.load(std::memory_order_acquire)) {
+            restart = true;
+        }
+        return node;
+    }
+
+    // leaf that may contain key together with its version
+    node_p find_leaf(const Key &key, uint64_t &version, bool &restart) const {
+        node_p node = lock_root(version, restart);
+        while (!restart && !node->m_leaf) {
+            node_p son = node->m_sons[node->upper_index(key)];
+            node->check(version, restart);
+            if (restart) {
+                break;
+            }
+            version = son->read_lock(restart);
+            node = son;
+        }
+        return node;
+    }
+
+    // both nodes are write-locked, parent is nullptr for the root
+    void split(node_p parent, node_p node) {
+        Key separator;
+        node_p right = node->split(m_alloc, separator);
+        if (parent) {
+            size_t index = parent->upper_index(separator);
+            parent->insert_son(index + 1, right);
+            parent->insert_key(index, separator);
+            parent->m_size.fetch_add(1, std::memory_order_relaxed);
+            return;
+        }
+        node_p root = node_t::create(m_alloc, false);
+        root->m_keys[0] = separator;
+        root->m_sons[0] = node;
+        root->m_sons[1] = right;
+        root->m_size.store(1, std::memory_order_relaxed);
+        m_root.store(root, std::memory_order_release);
+    }
+
+    // one optimistic attempt, returns false when it has to be restarted
+    bool try_insert(const Key &key, bool &inserted) {
+        bool restart = false;
+        uint64_t version = 0;
+        node_p node = lock_root(version, restart);
+        if (restart) {
+            return false;
+        }
+        node_p parent = nullptr;
+        uint64_t parent_version = 0;
+
+        while (true) {
+            if (node->is_full()) {
+                // split eagerly; parent has room as it was not full when passed
+                if (parent) {
+                    parent->upgrade(parent_version, restart);
+                    if (restart) {
+                        return false;
+                    }
+                }
+                node->upgrade(version, restart);
+                if (restart || (!parent && node != m_root.load(std::memory_order_acquire))) {
+                    if (!restart) {
+                        node->write_unlock();
+                    }
+                    if (parent) {
+                        parent->write_unlock();
+                    }
+                    return false;
+                }
+                split(parent, node);
+                node->write_unlock();
+                if (parent) {
+                    parent->write_unlock();
+                }
+                return false;
+            }
+            if (node->m_leaf) {
+                break;
+            }
+
+            if (parent) {
+                parent->check(parent_version, restart);
+                if (restart) {
+                    return false;
+                }
+            }
+            parent = node;
+            parent_version = version;
+            node = node->m_sons[node->upper_index(key)];
+            parent->check(parent_version, restart);
+            if (restart) {
+                return false;
+            }
+            version = node->read_lock(restart);
+            if (restart) {
+                return false;
+            }
+        }
+
+        node->upgrade(version, restart);
+        if (restart) {
+            return false;
+        }
+        if (parent) {
+            parent->check(parent_version, restart);
+            if (restart) {
+                node->write_unlock();
+                return false;
+            }
+        }
+        size_t index = node->lower_index(key);
+        inserted = index == node->size() || node->m_keys[index] != key;
+        if (inserted) {
+            node->insert_key(index, key);
+            node->m_size.fetch_add(1, std::memory_order_relaxed);
+        }
+        node->write_unlock();
+        return true;
+    }
+
+    bool try_erase(const Key &key, bool &erased) {
+        bool restart = false;
+        uint64_t version = 0;
+        node_p leaf = find_leaf(key, version, restart);
+        if (restart) {
+            return false;
+        }
+        leaf->upgrade(version, restart);
+        if (restart) {
+            return false;
+        }
+        size_t index = leaf->lower_index(key);
+        size_t size = leaf->size();
+        erased = index != size && leaf->m_keys[index] == key;
+        if (erased) {
+            std::move(leaf->m_keys.begin() + index + 1, leaf->m_keys.begin() + size,
+                      leaf->m_keys.begin() + index);
+            leaf->m_size.fetch_sub(1, std::memory_order_relaxed);
+        }
+        leaf->write_unlock();
+        return true;
+    }
+
+    bool try_contains(const Key &key, bool &found) const {
+        bool restart = false;
+        uint64_t version = 0;
+        node_p leaf = find_leaf(key, version, restart);
+        if (restart) {
+            return false;
+        }
+        size_t index = leaf->lower_index(key);
+        found = index != leaf->size() && leaf->m_keys[index] == key;
+        leaf->check(version, restart);
+        return !restart;
+    }
+
+  public:
+    ConcurrentBTree() : m_root(node_t::create(m_alloc, true)) {}
+    ConcurrentBTree(const ConcurrentBTree &) = delete;
+    ConcurrentBTree &operator=(const ConcurrentBTree &) = delete;
+
+    // no operation may run concurrently with destruction
+    ~ConcurrentBTree() { node_t::destroy_subtree(m_alloc, m_root.load()); }
+
+    bool insert(const Key &key) {
+        bool inserted = false;
+        for (size_t attempt = 0; !try_insert(key, inserted); ++attempt) {
+            backoff(attempt);
+        }
+        return inserted;
+    }
+
+    bool erase(const Key &key) {
+        bool erased = false;
+        for (size_t attempt = 0; !try_erase(key, erased); ++attempt) {
+            backoff(attempt);
+        }
+        return erased;
+    }
+
+    bool contains(const Key &key) const {
+        bool found = false;
+        for (size_t attempt = 0; !try_contains(key, found); ++attempt) {
+            backoff(attempt);
+        }
+        return found;
+    }
+
+    // number of keys in [begin, end], 0 if end <= begin. Every leaf is read
+    // consistently; keys that move right during a split are counted once,
+    // since splits only move keys to a new leaf after the one being read
+    size_t distance(const Key &begin, const Key &end) const {
+        if (end <= begin) {
+            return 0;
+        }
+        size_t counter = 0;
+        bool restart = true;
+        uint64_t version = 0;
+        node_p leaf = nullptr;
+        for (size_t attempt = 0; restart; ++attempt) {
+            backoff(attempt);
+            restart = false;
+            leaf = find_leaf(begin, version, restart);
+        }
+
+        while (true) {
+            size_t first = leaf->lower_index(begin);
+            size_t last = leaf->upper_index(end);
+            bool done = last < leaf->size();
+            node_p next = leaf->m_next.load(std::memory_order_acquire);
+            leaf->check(version, restart);
+            if (restart) {
+                // reread the same leaf, it may only have lost keys to the right
+                restart = false;
+                version = leaf->read_lock(restart);
+                while (restart) {
+                    std::this_thread::yield();
+                    restart = false;
+                    version = leaf->read_lock(restart);
+                }
+                continue;
+            }
+            counter += last > first ? last - first : 0;
+            if (done || !next) {
+                return counter;
+            }
+            leaf = next;
+            do {
+                restart = false;
+                version = leaf->read_lock(restart);
+            } while (restart);
+        }
+    }
+};
@@ -0,0 +1,147 @@
+#pragma once
+
+#include "NodeSearch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cstddef>
+#include <functional>
+#include <numeric>
+#include <span>
+#include <vector>
+
+// Immutable read-only copy of a tree, see BTree::freeze. Keys are laid out
+// as an implicit B+ tree in one array of cache-line blocks: the sorted keys
+// come first, then the upper layers up to the root. Block k of a layer has
+// the sons k * (B + 1) ... k * (B + 1) + B in the layer below and its key i
+// is the first key of son i + 1, so every descent is the same number of
+// steps of index arithmetic and ends at the position of the key among the
+// sorted ones. Blocks past the last key repeat it
+template <typename Key, typename Compare = std::less<Key>>
+class FrozenBTree final {
+  public:
+    // keys per block, one cache line of them
+    static constexpr size_t block_keys = std::max<size_t>(2, 64 / sizeof(Key));
+
+  private:
+    using search_t = NodeSearch<Key, Compare>;
+
+    struct alignas(64) Block {
+        std::array<Key, search_t::capacity(block_keys)> keys;
+    };
+
+    std::vector<Block> m_blocks;
+    // first block of each layer, the sorted keys are layer 0
+    std::vector<size_t> m_layers;
+    // multisets: m_ranks[i] is the number of keys before key i, the last
+    // entry is the number of all keys; empty when every key occurs once
+    std::vector<size_t> m_ranks;
+    size_t m_size = 0; // number of distinct keys
+
+    static bool less(const Key &lhs, const Key &rhs) { return Compare{}(lhs, rhs); }
+
+    const Key &key_at(size_t position) const {
+        return m_blocks[position / block_keys].keys[position % block_keys];
+    }
+
+    // number of keys of block less than key (or not greater if Upper)
+    template <bool Upper>
+    size_t index(size_t block, const Key &key) const {
+        const Key *keys = m_blocks[block].keys.data();
+        return Upper ? search_t::upper_index(keys, block_keys, key)
+                     : search_t::lower_index(keys, block_keys, key);
+    }
+
+    // number of distinct keys less than key (or not greater if Upper)
+    template <bool Upper>
+    size_t position(const Key &key) const {
+        if (m_size == 0) {
+            return 0;
+        }
+        // blocks are padded with the last key, so greater keys must not descend
+        const Key &last = key_at(m_size - 1);
+        if (Upper ? !less(key, last) : less(last, key)) {
+            return m_size;
+        }
+        size_t block = 0;
+        for (size_t layer = m_layers.size() - 1; layer != 0; --layer) {
+            block = block * (block_keys + 1) + index<Upper>(m_layers[layer] + block, key);
+        }
+        return block * block_keys + index<Upper>(block, key);
+    }
+
+    size_t rank_at(size_t position) const {
+        return m_ranks.empty() ? position : m_ranks[position];
+    }
+
+  public:
+    // keys are sorted and distinct, key i occurs counts[i] times, or once if
+    // counts are empty
+    explicit FrozenBTree(std::span<const Key> keys, std::span<const size_t> counts = {})
+        : m_size(keys.size()) {
+        if (keys.empty()) {
+            return;
+        }
+        size_t blocks = (keys.size() + block_keys - 1) / block_keys;
+        size_t total = blocks;
+        m_layers.push_back(0);
+        while (blocks > 1) {
+            blocks = (blocks + block_keys) / (block_keys + 1);
+            m_layers.push_back(total);
+            total += blocks;
+        }
+        m_layers.push_back(total);
+        m_blocks.resize(total);
+
+        for (size_t i = 0; i < m_layers[1] * block_keys; ++i) {
+            m_blocks[i / block_keys].keys[i % block_keys] = keys[std::min(i, keys.size() - 1)];
+        }
+        for (size_t layer = 1; layer + 1 < m_layers.size(); ++layer) {
+            for (size_t i = 0; i < (m_layers[layer + 1] - m_layers[layer]) * block_keys; ++i) {
+                // first key under son i % B + 1 of block i / B: leftmost leaf block
+                size_t son = i / block_keys * (block_keys + 1) + i % block_keys + 1;
+                for (size_t below = 1; below < layer; ++below) {
+                    son *= block_keys + 1;
+                }
+                m_blocks[m_layers[layer] + i / block_keys].keys[i % block_keys] =
+                    keys[std::min(son * block_keys, keys.size() - 1)];
+            }
+        }
+        // the end of the last layer is only needed while building
+        m_layers.pop_back();
+
+        if (!counts.empty()) {
+            m_ranks.resize(keys.size() + 1);
+            std::partial_sum(counts.begin(), counts.end(), m_ranks.begin() + 1);
+        }
+    }
+
+    size_t size() const { return rank_at(m_size); }
+    bool empty() const { return m_size == 0; }
+
+    // number of keys less than key
+    size_t rank(const Key &key) const { return rank_at(position<false>(key)); }
+
+    // number of keys in [begin, end], 0 if end <= begin like BTree::distance
+    size_t distance(const Key &begin, const Key &end) const {
+        if (!less(begin, end)) {
+            return 0;
+        }
+        return rank_at(position<true>(end)) - rank_at(position<false>(begin));
+    }
+
+    size_t count(const Key &key) const {
+        return rank_at(position<true>(key)) - rank_at(position<false>(key));
+    }
+
+    // stored key equal to key, nullptr if there is none
+    const Key *find(const Key &key) const {
+        size_t found = position<false>(key);
+        if (found == m_size || less(key, key_at(found))) {
+            return nullptr;
+        }
+        return &key_at(found);
+    }
+
+    bool contains(const Key &key) const { return find(key) != nullptr; }
+};
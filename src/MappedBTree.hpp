@@ -0,0 +1,319 @@
+#pragma once
+
+#include "BTreeIterator.hpp"
+#include "NodeSearch.hpp"
+
+#include <algorithm>
+#include <array>
+#include <cerrno>
+#include <cstdint>
+#include <stdexcept>
+#include <string>
+#include <system_error>
+#include <type_traits>
+#include <utility>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+template <typename Key, size_t N, template <typename> typename Allocator, typename Compare,
+          typename Value, typename Aggregate>
+class BTree;
+
+template <typename Key, size_t N>
+class MappedBTree;
+
+// BTree image layout: one header page, then nodes in breadth-first order, so
+// the root is the first node and upper levels share the first pages
+inline constexpr size_t image_page_size = 4096;
+
+// Nodes never straddle a page, which would cost two page faults per node:
+// a page holds as many nodes as fit and the rest of it is padding, a node
+// larger than a page starts one and is padded to whole pages
+struct ImageLayout {
+    size_t node_size;
+
+    size_t per_page() const { return std::max<size_t>(image_page_size / node_size, 1); }
+    // bytes of a run of per_page() nodes with its padding
+    size_t block() const {
+        return (per_page() * node_size + image_page_size - 1) / image_page_size * image_page_size;
+    }
+
+    // byte offset of node index from the first node
+    size_t offset(size_t index) const {
+        return index / per_page() * block() + index % per_page() * node_size;
+    }
+    // bytes from the first node to the end of the last of count nodes
+    size_t length(size_t count) const { return count == 0 ? 0 : offset(count - 1) + node_size; }
+    // index of the node at byte offset, count if no node starts there
+    size_t index(size_t offset, size_t count) const {
+        size_t index = offset / block() * per_page() + offset % block() / node_size;
+        return index < count && this->offset(index) == offset ? index : count;
+    }
+};
+
+struct ImageHeader {
+    static constexpr uint64_t magic_value = 0x474d494545525442; // "BTREEIMG"
+    static constexpr uint32_t format_version = 2;
+
+    uint64_t magic;
+    uint32_t version;
+    uint32_t key_size;
+    uint32_t degree;
+    uint32_t node_size;
+    uint64_t nodes;
+    uint64_t size; // number of keys
+};
+
+// Node as stored in an image: sons are byte offsets from the node itself
+// instead of pointers, so the image is valid wherever it is mapped
+template <typename Key, size_t N>
+struct alignas(64) ImageNode final {
+  private:
+    static constexpr size_t max_keys = 2 * N - 1;
+    static constexpr size_t max_sons = 2 * N;
+
+    using keys_t = std::array<Key, NodeSearch<Key>::capacity(max_keys)>;
+
+    template <typename, size_t, template <typename> typename, typename, typename, typename>
+    friend class BTree;
+    friend MappedBTree<Key, N>;
+    friend BTreeIterator<ImageNode>;
+
+    keys_t m_keys;
+    std::array<int64_t, max_sons> m_sons;
+    // same meaning as Node::m_prefix
+    std::array<uint64_t, max_sons> m_prefix;
+    uint64_t m_counter;
+    uint32_t m_size;
+    bool m_leaf;
+
+    size_t son_offset(size_t index) const { return index == 0 ? 0 : m_prefix[index - 1] + 1; }
+
+  public:
+    using value_type = Key;
+    using reference = const Key &;
+
+    size_t size() const { return m_size; }
+    size_t sons_count() const { return m_leaf ? 0 : m_size + 1; }
+    reference item(size_t index) const { return m_keys[index]; }
+
+    const ImageNode *son(size_t index) const {
+        return reinterpret_cast<const ImageNode *>(reinterpret_cast<const char *>(this) +
+                                                   m_sons[index]);
+    }
+
+    size_t lower_index(const Key &key) const {
+        return NodeSearch<Key>::lower_index(m_keys.data(), m_size, key);
+    }
+    size_t upper_index(const Key &key) const {
+        return NodeSearch<Key>::upper_index(m_keys.data(), m_size, key);
+    }
+
+    // number of keys in subtree less than key (or not greater if upper)
+    size_t rank(const Key &key, bool upper) const {
+        size_t counter = 0;
+        const ImageNode *node = this;
+        while (true) {
+            size_t index = upper ? node->upper_index(key) : node->lower_index(key);
+            if (node->m_leaf) {
+                return counter + index;
+            }
+            if (!upper && index != node->m_size && node->m_keys[index] == key) {
+                return counter + node->m_prefix[index];
+            }
+            if (upper && index != 0 && node->m_keys[index - 1] == key) {
+                return counter + node->m_prefix[index - 1] + 1;
+            }
+            counter += node->son_offset(index);
+            node = node->son(index);
+        }
+    }
+
+    // first key not less than key (or greater than key if upper), {} if none
+    BTreeIterator<ImageNode> bound(const Key &key, bool upper) const {
+        BTreeIterator<ImageNode> result;
+        const ImageNode *node = this;
+        while (true) {
+            size_t index = upper ? node->upper_index(key) : node->lower_index(key);
+            if (index != node->m_size) {
+                result = {this, node, static_cast<ssize_t>(index)};
+                if (!upper && node->m_keys[index] == key) {
+                    return result;
+                }
+            }
+            if (node->m_leaf) {
+                return result;
+            }
+            node = node->son(index);
+        }
+    }
+};
+
+// Read-only view of an image written by BTree<Key, N>::save. Opening maps the
+// file without reading it, pages are loaded lazily through the page cache
+template <typename Key, size_t N>
+class MappedBTree final {
+  private:
+    static_assert(std::is_trivially_copyable_v<Key>, "mapped keys must be trivially copyable");
+
+    using node_t = ImageNode<Key, N>;
+
+    void *m_data = nullptr;
+    size_t m_length = 0;
+    const node_t *m_root = nullptr;
+    size_t m_size = 0;
+
+    void unmap() {
+        if (m_data) {
+            ::munmap(m_data, m_length);
+        }
+        m_data = nullptr;
+    }
+
+  public:
+    using const_iterator = BTreeIterator<node_t>;
+    using iterator = const_iterator;
+
+    static_assert(std::bidirectional_iterator<const_iterator>);
+
+    // throws std::system_error if file can't be mapped and std::runtime_error
+    // if it is not an image of BTree<Key, N>
+    explicit MappedBTree(const std::string &path) {
+        int fd = ::open(path.c_str(), O_RDONLY);
+        if (fd < 0) {
+            throw std::system_error(errno, std::generic_category(), path);
+        }
+        struct stat info;
+        if (::fstat(fd, &info) != 0) {
+            int error = errno;
+            ::close(fd);
+            throw std::system_error(error, std::generic_category(), path);
+        }
+        m_length = info.st_size;
+        if (m_length < image_page_size) {
+            ::close(fd);
+            throw std::runtime_error(path + ": not a BTree image");
+        }
+        void *data = ::mmap(nullptr, m_length, PROT_READ, MAP_SHARED, fd, 0);
+        int error = errno;
+        ::close(fd);
+        if (data == MAP_FAILED) {
+            throw std::system_error(error, std::generic_category(), path);
+        }
+        m_data = data;
+
+        const auto &header = *static_cast<const ImageHeader *>(m_data);
+        if (header.magic != ImageHeader::magic_value ||
+            header.version != ImageHeader::format_version || header.key_size != sizeof(Key) ||
+            header.degree != N || header.node_size != sizeof(node_t) ||
+            m_length < image_page_size + ImageLayout{sizeof(node_t)}.length(header.nodes)) {
+            unmap();
+            throw std::runtime_error(path + ": not a BTree image of this type");
+        }
+        m_size = header.size;
+        if (header.nodes != 0) {
+            m_root = reinterpret_cast<const node_t *>(static_cast<const char *>(m_data) +
+                                                      image_page_size);
+        }
+    }
+
+    MappedBTree(const MappedBTree &) = delete;
+    MappedBTree &operator=(const MappedBTree &) = delete;
+
+    MappedBTree(MappedBTree &&other)
+        : m_data(std::exchange(other.m_data, nullptr)), m_length(other.m_length),
+          m_root(std::exchange(other.m_root, nullptr)), m_size(std::exchange(other.m_size, 0)) {}
+
+    MappedBTree &operator=(MappedBTree &&other) {
+        if (this != std::addressof(other)) {
+            unmap();
+            m_data = std::exchange(other.m_data, nullptr);
+            m_length = other.m_length;
+            m_root = std::exchange(other.m_root, nullptr);
+            m_size = std::exchange(other.m_size, 0);
+        }
+        return *this;
+    }
+
+    ~MappedBTree() { unmap(); }
+
+    size_t size() const { return m_size; }
+    bool empty() const { return m_size == 0; }
+
+    // Checks that every node of the image has at most 2N - 1 keys and that
+    // its sons are nodes of the image further on, so descents stay inside
+    // the mapping and end. Queries trust the file, opening doesn't read
+    // every page to keep loading lazy; call this on files of unknown origin.
+    // O(nodes)
+    bool verify() const {
+        if (!m_root) {
+            return true;
+        }
+        const auto &header = *static_cast<const ImageHeader *>(m_data);
+        const ImageLayout layout{sizeof(node_t)};
+        const char *first = static_cast<const char *>(m_data) + image_page_size;
+        for (size_t i = 0; i < header.nodes; ++i) {
+            const auto &node = *reinterpret_cast<const node_t *>(first + layout.offset(i));
+            if (node.m_size > node_t::max_keys) {
+                return false;
+            }
+            for (size_t j = 0; j < node.sons_count(); ++j) {
+                if (node.m_sons[j] <= 0) {
+                    return false;
+                }
+                size_t offset = layout.offset(i) + node.m_sons[j];
+                if (layout.index(offset, header.nodes) == header.nodes) {
+                    return false;
+                }
+            }
+        }
+        return true;
+    }
+
+    size_t rank(const Key &key) const { return m_root ? m_root->rank(key, false) : 0; }
+
+    size_t distance(const Key &begin, const Key &end) const {
+        if (!m_root || end <= begin) {
+            return 0;
+        }
+        return m_root->rank(end, true) - m_root->rank(begin, false);
+    }
+
+    const_iterator cbegin() const {
+        const node_t *begin = m_root;
+        if (begin) {
+            while (!begin->m_leaf) {
+                begin = begin->son(0);
+            }
+        }
+        return const_iterator(m_root, begin, 0);
+    }
+    const_iterator cend() const {
+        return (m_root ? const_iterator(m_root, m_root, m_root->m_size) : const_iterator());
+    }
+    const_iterator begin() const { return cbegin(); }
+    const_iterator end() const { return cend(); }
+
+    const_iterator lower_bound(const Key &key) const {
+        if (!m_root) {
+            return cend();
+        }
+        auto result = m_root->bound(key, false);
+        return (result == const_iterator() ? cend() : result);
+    }
+    const_iterator upper_bound(const Key &key) const {
+        if (!m_root) {
+            return cend();
+        }
+        auto result = m_root->bound(key, true);
+        return (result == const_iterator() ? cend() : result);
+    }
+
+    const_iterator find(const Key &key) const {
+        auto result = lower_bound(key);
+        return (result != cend() && *result == key) ? result : cend();
+    }
+};
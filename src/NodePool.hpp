@@ -0,0 +1,183 @@
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstddef>
+#include <new>
+#include <utility>
+#include <vector>
+
+// Node allocation policies for BTree.
+// allocate() returns raw storage for one T, deallocate() takes it back.
+// Policies that own all of their storage may also provide release(), which
+// frees everything at once without touching the objects that live there.
+// Policies whose deallocate() is not thread-safe may provide defer(), a
+// deallocate() that any thread may call while the policy is in use.
+
+template <typename T>
+class HeapAllocator final {
+  public:
+    T *allocate() { return static_cast<T *>(::operator new(sizeof(T), std::align_val_t{alignof(T)})); }
+
+    void deallocate(T *ptr) { ::operator delete(ptr, std::align_val_t{alignof(T)}); }
+};
+
+// slab allocator: nodes are carved from geometrically growing slabs and
+// freed nodes are recycled through an intrusive free list of runs
+template <typename T>
+class NodePool final {
+  private:
+    static constexpr size_t min_slab = 8;
+    static constexpr size_t max_slab = 1024;
+
+    // count free nodes starting here; deallocate() pushes runs of one and
+    // merge() hands over the untouched rest of a slab as a single run
+    struct FreeNode {
+        FreeNode *next;
+        size_t count;
+    };
+    static_assert(sizeof(T) >= sizeof(FreeNode));
+
+    struct Slab {
+        T *data;
+        size_t size;
+    };
+
+    std::vector<Slab> m_slabs;
+    FreeNode *m_free = nullptr;
+    FreeNode *m_free_tail = nullptr; // lets merge() splice free lists
+    size_t m_used = 0; // nodes taken from the last slab
+    // runs of one pushed by defer() on any thread, taken over by allocate()
+    std::atomic<FreeNode *> m_deferred = nullptr;
+
+  public:
+    NodePool() = default;
+    // a copy starts empty: snapshots share one pool through BTree::m_alloc
+    // and never copy it, so no node is ever owned by two pools
+    NodePool(const NodePool &) : NodePool() {}
+    NodePool(NodePool &&other) noexcept
+        : m_slabs(std::move(other.m_slabs)), m_free(std::exchange(other.m_free, nullptr)),
+          m_free_tail(std::exchange(other.m_free_tail, nullptr)),
+          m_used(std::exchange(other.m_used, 0)),
+          m_deferred(other.m_deferred.exchange(nullptr, std::memory_order_relaxed)) {
+        other.m_slabs.clear();
+    }
+
+    NodePool &operator=(NodePool other) noexcept {
+        swap(other);
+        return *this;
+    }
+
+    ~NodePool() { release(); }
+
+    void swap(NodePool &other) noexcept {
+        std::swap(m_slabs, other.m_slabs);
+        std::swap(m_free, other.m_free);
+        std::swap(m_free_tail, other.m_free_tail);
+        std::swap(m_used, other.m_used);
+        other.m_deferred.store(
+            m_deferred.exchange(other.m_deferred.load(std::memory_order_relaxed),
+                                std::memory_order_relaxed),
+            std::memory_order_relaxed);
+    }
+
+    T *allocate() {
+        if (!m_free) {
+            reclaim();
+        }
+        if (m_free && m_free->count > 1) {
+            return reinterpret_cast<T *>(m_free) + --m_free->count;
+        }
+        if (m_free) {
+            T *ptr = reinterpret_cast<T *>(std::exchange(m_free, m_free->next));
+            if (!m_free) {
+                m_free_tail = nullptr;
+            }
+            return ptr;
+        }
+        if (m_slabs.empty() || m_used == m_slabs.back().size) {
+            size_t size = m_slabs.empty() ? min_slab : std::min(2 * m_slabs.back().size, max_slab);
+            m_slabs.push_back({static_cast<T *>(::operator new(size * sizeof(T),
+                                                               std::align_val_t{alignof(T)})),
+                               size});
+            m_used = 0;
+        }
+        return m_slabs.back().data + m_used++;
+    }
+
+    void deallocate(T *ptr) { push_run(ptr, 1); }
+
+    // deallocate() for threads other than the one that allocates, e.g. a
+    // reader dropping the last reference to a node shared with a snapshot
+    void defer(T *ptr) {
+        FreeNode *node = ::new (static_cast<void *>(ptr))
+            FreeNode{m_deferred.load(std::memory_order_relaxed), 1};
+        while (!m_deferred.compare_exchange_weak(node->next, node, std::memory_order_release,
+                                                 std::memory_order_relaxed)) {
+        }
+    }
+
+    // takes over all storage of other, so nodes allocated there may be
+    // deallocated here; other is left empty
+    void merge(NodePool &other) {
+        other.reclaim();
+        if (!other.m_slabs.empty() && other.m_used < other.m_slabs.back().size) {
+            const Slab &last = other.m_slabs.back();
+            other.push_run(last.data + other.m_used, last.size - other.m_used);
+        }
+        if (other.m_free) {
+            other.m_free_tail->next = std::exchange(m_free, other.m_free);
+            if (!m_free_tail) {
+                m_free_tail = other.m_free_tail;
+            }
+        }
+        // the last slab of this pool keeps serving allocate()
+        if (m_slabs.empty()) {
+            m_slabs = std::move(other.m_slabs);
+            m_used = m_slabs.empty() ? 0 : m_slabs.back().size;
+        } else {
+            m_slabs.insert(m_slabs.end() - 1, other.m_slabs.begin(), other.m_slabs.end());
+        }
+        other.m_slabs.clear();
+        other.m_free = nullptr;
+        other.m_free_tail = nullptr;
+        other.m_used = 0;
+    }
+
+    // drop the whole arena, objects inside are not destroyed
+    void release() {
+        for (const Slab &slab : m_slabs) {
+            ::operator delete(slab.data, std::align_val_t{alignof(T)});
+        }
+        m_slabs.clear();
+        m_free = nullptr;
+        m_free_tail = nullptr;
+        m_used = 0;
+        m_deferred.store(nullptr, std::memory_order_relaxed);
+    }
+
+  private:
+    // moves deferred nodes to the free list; each one is walked once here,
+    // which defer() paid for
+    void reclaim() {
+        if (!m_deferred.load(std::memory_order_relaxed)) {
+            return;
+        }
+        FreeNode *first = m_deferred.exchange(nullptr, std::memory_order_acquire);
+        FreeNode *last = first;
+        while (last->next) {
+            last = last->next;
+        }
+        last->next = std::exchange(m_free, first);
+        if (!m_free_tail) {
+            m_free_tail = last;
+        }
+    }
+
+    void push_run(T *ptr, size_t count) {
+        m_free = ::new (static_cast<void *>(ptr)) FreeNode{m_free, count};
+        if (!m_free_tail) {
+            m_free_tail = m_free;
+        }
+    }
+};
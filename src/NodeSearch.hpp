@@ -0,0 +1,174 @@
+#pragma once
+
+#include <algorithm>
+#include <bit>
+#include <cstddef>
+#include <cstdint>
+#include <functional>
+#include <type_traits>
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+    #include <immintrin.h>
+#endif
+
+// Intra-node key search. Both functions return indexes in keys[0, size):
+// lower_index is the first key not less than key, upper_index is the first
+// key greater than key. Key storage must stay readable up to capacity(size).
+// Keys are ordered by a default constructed Compare; key may be of another
+// type when Compare is transparent.
+
+template <typename Key, typename Compare = std::less<Key>>
+struct BinarySearch {
+    static constexpr size_t capacity(size_t size) { return size; }
+
+    template <typename K>
+    static size_t lower_index(const Key *keys, size_t size, const K &key) {
+        return std::lower_bound(keys, keys + size, key, Compare{}) - keys;
+    }
+    template <typename K>
+    static size_t upper_index(const Key *keys, size_t size, const K &key) {
+        return std::upper_bound(keys, keys + size, key, Compare{}) - keys;
+    }
+};
+
+// search used by Node, vectorized below for keys that fit in SIMD lanes
+template <typename Key, typename Compare = std::less<Key>>
+struct NodeSearch : BinarySearch<Key, Compare> {};
+
+#if defined(__AVX2__) || defined(__SSE4_2__)
+
+// keys are sorted, so lower_index is the number of keys less than key and
+// upper_index is size minus the number of keys greater than key; both are
+// counted branchlessly over whole vectors, lanes past size are masked out
+template <typename Key>
+struct VectorSearch {
+  private:
+    #if defined(__AVX2__)
+    static constexpr size_t lanes = 32 / sizeof(Key);
+
+    static unsigned mask_less(const Key *keys, Key key) {
+        if constexpr (std::is_same_v<Key, float>) {
+            __m256 block = _mm256_loadu_ps(keys);
+            return _mm256_movemask_ps(_mm256_cmp_ps(block, _mm256_set1_ps(key), _CMP_LT_OQ));
+        } else if constexpr (std::is_same_v<Key, double>) {
+            __m256d block = _mm256_loadu_pd(keys);
+            return _mm256_movemask_pd(_mm256_cmp_pd(block, _mm256_set1_pd(key), _CMP_LT_OQ));
+        } else if constexpr (sizeof(Key) == 4) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys));
+            __m256i cmp = _mm256_cmpgt_epi32(_mm256_set1_epi32(key), block);
+            return _mm256_movemask_ps(_mm256_castsi256_ps(cmp));
+        } else {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys));
+            __m256i cmp = _mm256_cmpgt_epi64(_mm256_set1_epi64x(key), block);
+            return _mm256_movemask_pd(_mm256_castsi256_pd(cmp));
+        }
+    }
+
+    static unsigned mask_greater(const Key *keys, Key key) {
+        if constexpr (std::is_same_v<Key, float>) {
+            __m256 block = _mm256_loadu_ps(keys);
+            return _mm256_movemask_ps(_mm256_cmp_ps(block, _mm256_set1_ps(key), _CMP_GT_OQ));
+        } else if constexpr (std::is_same_v<Key, double>) {
+            __m256d block = _mm256_loadu_pd(keys);
+            return _mm256_movemask_pd(_mm256_cmp_pd(block, _mm256_set1_pd(key), _CMP_GT_OQ));
+        } else if constexpr (sizeof(Key) == 4) {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys));
+            __m256i cmp = _mm256_cmpgt_epi32(block, _mm256_set1_epi32(key));
+            return _mm256_movemask_ps(_mm256_castsi256_ps(cmp));
+        } else {
+            __m256i block = _mm256_loadu_si256(reinterpret_cast<const __m256i *>(keys));
+            __m256i cmp = _mm256_cmpgt_epi64(block, _mm256_set1_epi64x(key));
+            return _mm256_movemask_pd(_mm256_castsi256_pd(cmp));
+        }
+    }
+    #else
+    static constexpr size_t lanes = 16 / sizeof(Key);
+
+    static unsigned mask_less(const Key *keys, Key key) {
+        if constexpr (std::is_same_v<Key, float>) {
+            return _mm_movemask_ps(_mm_cmplt_ps(_mm_loadu_ps(keys), _mm_set1_ps(key)));
+        } else if constexpr (std::is_same_v<Key, double>) {
+            return _mm_movemask_pd(_mm_cmplt_pd(_mm_loadu_pd(keys), _mm_set1_pd(key)));
+        } else if constexpr (sizeof(Key) == 4) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys));
+            return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmplt_epi32(block, _mm_set1_epi32(key))));
+        } else {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys));
+            __m128i cmp = _mm_cmpgt_epi64(_mm_set1_epi64x(key), block);
+            return _mm_movemask_pd(_mm_castsi128_pd(cmp));
+        }
+    }
+
+    static unsigned mask_greater(const Key *keys, Key key) {
+        if constexpr (std::is_same_v<Key, float>) {
+            return _mm_movemask_ps(_mm_cmpgt_ps(_mm_loadu_ps(keys), _mm_set1_ps(key)));
+        } else if constexpr (std::is_same_v<Key, double>) {
+            return _mm_movemask_pd(_mm_cmpgt_pd(_mm_loadu_pd(keys), _mm_set1_pd(key)));
+        } else if constexpr (sizeof(Key) == 4) {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys));
+            return _mm_movemask_ps(_mm_castsi128_ps(_mm_cmpgt_epi32(block, _mm_set1_epi32(key))));
+        } else {
+            __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(keys));
+            __m128i cmp = _mm_cmpgt_epi64(block, _mm_set1_epi64x(key));
+            return _mm_movemask_pd(_mm_castsi128_pd(cmp));
+        }
+    }
+    #endif
+
+  public:
+    static constexpr size_t capacity(size_t size) { return (size + lanes - 1) / lanes * lanes; }
+
+    // a linear scan only beats binary search while the block spans a few vectors
+    static constexpr size_t max_vectors = 8;
+
+    static size_t lower_index(const Key *keys, size_t size, const Key &key) {
+        if (size > max_vectors * lanes) {
+            return BinarySearch<Key>::lower_index(keys, size, key);
+        }
+        size_t counter = 0;
+        size_t i = 0;
+        for (; i + lanes <= size; i += lanes) {
+            counter += std::popcount(mask_less(keys + i, key));
+        }
+        if (i < size) {
+            counter += std::popcount(mask_less(keys + i, key) & ((1u << (size - i)) - 1));
+        }
+        return counter;
+    }
+
+    static size_t upper_index(const Key *keys, size_t size, const Key &key) {
+        if (size > max_vectors * lanes) {
+            return BinarySearch<Key>::upper_index(keys, size, key);
+        }
+        size_t counter = 0;
+        size_t i = 0;
+        for (; i + lanes <= size; i += lanes) {
+            counter += std::popcount(mask_greater(keys + i, key));
+        }
+        if (i < size) {
+            counter += std::popcount(mask_greater(keys + i, key) & ((1u << (size - i)) - 1));
+        }
+        return size - counter;
+    }
+
+    // keys of other types are compared exactly instead of being converted to Key
+    template <typename K>
+    static size_t lower_index(const Key *keys, size_t size, const K &key) {
+        return BinarySearch<Key, std::less<>>::lower_index(keys, size, key);
+    }
+    template <typename K>
+    static size_t upper_index(const Key *keys, size_t size, const K &key) {
+        return BinarySearch<Key, std::less<>>::upper_index(keys, size, key);
+    }
+};
+
+template <typename Key>
+concept vector_key = std::is_same_v<Key, int32_t> || std::is_same_v<Key, int64_t> ||
+                     std::is_same_v<Key, float> || std::is_same_v<Key, double>;
+
+// lanes are compared with <, so only the natural order is vectorized
+template <vector_key Key, typename Compare>
+    requires std::is_same_v<Compare, std::less<Key>> || std::is_same_v<Compare, std::less<>>
+struct NodeSearch<Key, Compare> : VectorSearch<Key> {};
+
+#endif
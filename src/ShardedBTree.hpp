@@ -0,0 +1,538 @@
+#pragma once
+
+#include "Btree.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <span>
+#include <stdexcept>
+#include <thread>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+// Fixed set of worker threads that run jobs together with the calling
+// thread. A job submitted while another one runs is done by its caller alone,
+// so callers never wait for each other.
+class WorkerPool final {
+  private:
+    std::vector<std::thread> m_workers;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_done;
+    std::mutex m_submit; // held while a job runs
+
+    // current job, set under m_mutex before workers are woken
+    const std::function<void(size_t)> *m_task = nullptr;
+    size_t m_count = 0;
+    std::atomic<size_t> m_next{0};
+    size_t m_busy = 0; // workers still in the job
+    uint64_t m_generation = 0;
+    bool m_stop = false;
+
+    void work() {
+        for (size_t index; (index = m_next.fetch_add(1)) < m_count;) {
+            (*m_task)(index);
+        }
+    }
+
+    void loop() {
+        uint64_t seen = 0;
+        std::unique_lock lock(m_mutex);
+        while (true) {
+            m_wake.wait(lock, [&] { return m_stop || m_generation != seen; });
+            if (m_stop) {
+                return;
+            }
+            seen = m_generation;
+            lock.unlock();
+            work();
+            lock.lock();
+            if (--m_busy == 0) {
+                m_done.notify_one();
+            }
+        }
+    }
+
+  public:
+    // threads counts the caller, so threads - 1 workers are started
+    explicit WorkerPool(size_t threads) {
+        for (size_t i = 1; i < threads; ++i) {
+            m_workers.emplace_back([this] { loop(); });
+        }
+    }
+
+    WorkerPool(const WorkerPool &) = delete;
+    WorkerPool &operator=(const WorkerPool &) = delete;
+
+    ~WorkerPool() {
+        {
+            std::lock_guard lock(m_mutex);
+            m_stop = true;
+        }
+        m_wake.notify_all();
+        for (std::thread &worker : m_workers) {
+            worker.join();
+        }
+    }
+
+    size_t threads() const { return m_workers.size() + 1; }
+
+    // calls func(i) for i in [0, count) and returns when all calls are done
+    template <typename Func>
+    void run(size_t count, Func func) {
+        std::unique_lock submit(m_submit, std::try_to_lock);
+        if (!submit || m_workers.empty() || count < 2) {
+            for (size_t i = 0; i < count; ++i) {
+                func(i);
+            }
+            return;
+        }
+        std::function<void(size_t)> task(std::ref(func));
+        {
+            std::lock_guard lock(m_mutex);
+            m_task = &task;
+            m_count = count;
+            m_next.store(0, std::memory_order_relaxed);
+            m_busy = m_workers.size();
+            m_generation += 1;
+        }
+        m_wake.notify_all();
+        work();
+        std::unique_lock lock(m_mutex);
+        m_done.wait(lock, [&] { return m_busy == 0; });
+        m_task = nullptr;
+    }
+};
+
+// Set split by key ranges over independent BTree shards: shard i holds the
+// keys k with bounds[i - 1] <= k < bounds[i]. Every shard has its own tree
+// and lock, so writes whose keys fall into different shards run on
+// different threads without contending. There is no lock over the
+// whole tree: calls lock the shards they read or write, always in index
+// order, and bounds are atomics that are re-checked once a shard is locked.
+//
+// Bounds move when shards skew: every balance_interval writes a shard
+// compares its size with the average and evens itself out with a
+// neighbour, locking just the two. rebalance evens out all shards at once.
+// Keys move by BTree::split and BTree::join in O(log n) without copies,
+// which needs nodes that any shard may free: the allocator must be
+// stateless and thread-safe, so the default is HeapAllocator. A NodePool
+// per shard would have to copy every moved key.
+//
+// distance and rank lock just the shards holding their ends, the shards
+// between them are summed from cached counts without locks. The shards of a
+// distance_many batch are looked up on a pool of worker threads kept by the
+// tree.
+template <typename Key, size_t N, template <typename> typename Allocator = HeapAllocator>
+class ShardedBTree final {
+  private:
+    // routing reads bounds while neighbours may move them
+    static_assert(std::is_trivially_copyable_v<Key>, "bounds are read without locks");
+
+    using tree_t = BTree<Key, N, Allocator>;
+    static_assert(std::is_empty_v<typename tree_t::allocator_type>,
+                  "shards free each other's nodes, so the allocator must be stateless");
+    using lock_t = std::unique_lock<std::mutex>;
+
+    // writes between skew checks of a shard
+    static constexpr size_t balance_interval = 1024;
+    // a shard this many times larger or smaller than the average is evened
+    // out with a neighbour
+    static constexpr double max_skew = 1.5;
+
+    // one cache line per shard, writers of neighbours don't share it
+    struct alignas(64) Shard {
+        std::mutex lock;
+        tree_t tree;
+        std::atomic<size_t> count{0}; // tree.size() for readers without the lock
+        size_t writes = 0;            // guarded by lock
+    };
+
+    // bound i is only stored with shards i and i + 1 locked
+    std::vector<std::atomic<Key>> m_bounds;
+    mutable std::vector<Shard> m_shards;
+    mutable WorkerPool m_pool;
+    // the low half counts moves of keys between shards in progress, the
+    // high half the finished ones. Counts may be stale while a move runs,
+    // so readers of counts retry when it changes under them
+    std::atomic<uint64_t> m_moves{0};
+    static constexpr uint64_t moves_running = (uint64_t{1} << 32) - 1;
+
+    Key bound(size_t index) const { return m_bounds[index].load(std::memory_order_relaxed); }
+
+    // key belongs to shard index; exact while the shard is locked
+    bool in_shard(size_t index, const Key &key) const {
+        return (index == 0 || !(key < bound(index - 1))) &&
+               (index == m_bounds.size() || key < bound(index));
+    }
+
+    // locks the shards of begin and end, one lock if they are the same,
+    // and returns their indices. Shards between them stay unlocked
+    std::pair<size_t, size_t> lock_ends(const Key &begin, const Key &end, lock_t &first_lock,
+                                        lock_t &last_lock) const {
+        while (true) {
+            size_t first = shard_of(begin);
+            size_t last = shard_of(end);
+            if (last < first) {
+                // bounds moved between the two lookups
+                continue;
+            }
+            first_lock = lock_t(m_shards[first].lock);
+            if (last != first) {
+                last_lock = lock_t(m_shards[last].lock);
+            }
+            if (in_shard(first, begin) && in_shard(last, end)) {
+                return {first, last};
+            }
+            if (last_lock) {
+                last_lock.unlock();
+            }
+            first_lock.unlock();
+        }
+    }
+
+    // locks the shard key belongs to and returns its index
+    size_t lock_shard(const Key &key, lock_t &lock) const {
+        while (true) {
+            size_t index = shard_of(key);
+            lock = lock_t(m_shards[index].lock);
+            if (in_shard(index, key)) {
+                return index;
+            }
+            // a stale shard is released before the next one is locked,
+            // which may come before it
+            lock.unlock();
+        }
+    }
+
+    void lock_all(std::vector<lock_t> &locks) const {
+        for (Shard &shard : m_shards) {
+            locks.emplace_back(shard.lock);
+        }
+    }
+
+    // keys in shards first..last - 1 by their cached counts. Writers of
+    // those shards are not blocked, a count is exact as of its own load
+    size_t count_between(size_t first, size_t last) const {
+        while (true) {
+            uint64_t moves = m_moves.load();
+            if ((moves & moves_running) != 0) {
+                std::this_thread::yield();
+                continue;
+            }
+            size_t result = 0;
+            for (size_t i = first; i < last; ++i) {
+                result += m_shards[i].count.load();
+            }
+            if (m_moves.load() == moves) {
+                return result;
+            }
+        }
+    }
+
+    // number of keys of shard index not less than key
+    size_t tail_count(size_t index, const Key &key) const {
+        const tree_t &tree = m_shards[index].tree;
+        return tree.size() - tree.rank(key);
+    }
+
+    // number of keys of shard index not greater than key
+    size_t head_count(size_t index, const Key &key) const {
+        const tree_t &tree = m_shards[index].tree;
+        return tree.rank(key) + tree.count(key);
+    }
+
+    // keys of shard index from its rank-th one on move to the front of the
+    // next shard, both locked, in O(log n)
+    void move_tail(size_t index, size_t rank) {
+        Key moved_bound = *m_shards[index].tree.select(rank);
+        tree_t moved = m_shards[index].tree.split(moved_bound);
+        moved.join(std::move(m_shards[index + 1].tree));
+        m_shards[index + 1].tree = std::move(moved);
+        m_bounds[index].store(moved_bound, std::memory_order_relaxed);
+    }
+
+    // first count keys of shard index + 1 move to the end of shard index
+    void move_head(size_t index, size_t count) {
+        Key moved_bound = *m_shards[index + 1].tree.select(count);
+        tree_t rest = m_shards[index + 1].tree.split(moved_bound);
+        m_shards[index].tree.join(std::move(m_shards[index + 1].tree));
+        m_shards[index + 1].tree = std::move(rest);
+        m_bounds[index].store(moved_bound, std::memory_order_relaxed);
+    }
+
+    void begin_move() { m_moves.fetch_add(1); }
+    // one finished move more, one running move less
+    void end_move() { m_moves.fetch_add(moves_running); }
+
+    void recount(size_t index) { m_shards[index].count.store(m_shards[index].tree.size()); }
+
+    // evens out shard index with its smaller neighbour if it is too large,
+    // or with its larger one if it is too small
+    void balance(size_t index) {
+        size_t shards = m_shards.size();
+        if (shards < 2) {
+            return;
+        }
+        auto count = [&](size_t i) { return m_shards[i].count.load(std::memory_order_relaxed); };
+        double average = static_cast<double>(size()) / shards;
+        size_t left = index == 0 ? 1 : index - 1;
+        size_t right = index + 1 == shards ? index - 1 : index + 1;
+        size_t neighbour;
+        if (count(index) > max_skew * average + balance_interval) {
+            neighbour = count(left) < count(right) ? left : right;
+        } else if (count(index) * max_skew + balance_interval < average) {
+            neighbour = count(left) < count(right) ? right : left;
+        } else {
+            return;
+        }
+        size_t first = std::min(index, neighbour);
+        lock_t first_lock(m_shards[first].lock);
+        lock_t second_lock(m_shards[first + 1].lock);
+        begin_move();
+        size_t first_size = m_shards[first].tree.size();
+        size_t second_size = m_shards[first + 1].tree.size();
+        if (first_size > second_size + 1) {
+            move_tail(first, first_size - (first_size - second_size) / 2);
+        } else if (second_size > first_size + 1) {
+            move_head(first, (second_size - first_size) / 2);
+        }
+        recount(first);
+        recount(first + 1);
+        end_move();
+    }
+
+  public:
+    // bounds.size() + 1 shards, bounds must be strictly increasing or
+    // std::invalid_argument is thrown. Queries fan out over threads threads,
+    // the caller included
+    explicit ShardedBTree(const std::vector<Key> &bounds, size_t threads = 1)
+        : m_bounds(bounds.size()), m_shards(bounds.size() + 1), m_pool(threads) {
+        auto unordered = [](const Key &lhs, const Key &rhs) { return !(lhs < rhs); };
+        if (std::adjacent_find(bounds.begin(), bounds.end(), unordered) != bounds.end()) {
+            throw std::invalid_argument("ShardedBTree: bounds must be strictly increasing");
+        }
+        for (size_t i = 0; i < bounds.size(); ++i) {
+            m_bounds[i].store(bounds[i], std::memory_order_relaxed);
+        }
+    }
+
+    ShardedBTree(const ShardedBTree &) = delete;
+    ShardedBTree &operator=(const ShardedBTree &) = delete;
+
+    size_t shards() const { return m_shards.size(); }
+
+    // current bounds, they may move right after the call
+    std::vector<Key> bounds() const {
+        std::vector<Key> result;
+        for (size_t i = 0; i < m_bounds.size(); ++i) {
+            result.push_back(bound(i));
+        }
+        return result;
+    }
+
+    // index of the shard key belongs to, it may move right after the call
+    size_t shard_of(const Key &key) const {
+        auto above = [](const Key &key, const std::atomic<Key> &bound) {
+            return key < bound.load(std::memory_order_relaxed);
+        };
+        return std::upper_bound(m_bounds.begin(), m_bounds.end(), key, above) - m_bounds.begin();
+    }
+
+    // one shard, only to be read while no other thread uses the tree
+    const tree_t &shard(size_t index) const { return m_shards[index].tree; }
+
+    bool insert(const Key &key) {
+        lock_t lock;
+        size_t index = lock_shard(key, lock);
+        Shard &shard = m_shards[index];
+        bool inserted = shard.tree.insert(key);
+        if (inserted) {
+            shard.count.fetch_add(1, std::memory_order_relaxed);
+        }
+        bool check = ++shard.writes % balance_interval == 0;
+        lock.unlock();
+        if (check) {
+            balance(index);
+        }
+        return inserted;
+    }
+
+    bool erase(const Key &key) {
+        lock_t lock;
+        size_t index = lock_shard(key, lock);
+        Shard &shard = m_shards[index];
+        bool erased = shard.tree.erase(key);
+        if (erased) {
+            shard.count.fetch_sub(1, std::memory_order_relaxed);
+        }
+        bool check = ++shard.writes % balance_interval == 0;
+        lock.unlock();
+        if (check) {
+            balance(index);
+        }
+        return erased;
+    }
+
+    bool contains(const Key &key) const {
+        lock_t lock;
+        return m_shards[lock_shard(key, lock)].tree.count(key) != 0;
+    }
+
+    // sum of cached counts, taken without locks: keys that a concurrent
+    // balance moves between shards may be counted twice or not at all
+    size_t size() const {
+        size_t result = 0;
+        for (const Shard &shard : m_shards) {
+            result += shard.count.load(std::memory_order_relaxed);
+        }
+        return result;
+    }
+    bool empty() const { return size() == 0; }
+
+    // number of keys less than key; only the shard of key is locked
+    size_t rank(const Key &key) const {
+        lock_t lock;
+        size_t index = lock_shard(key, lock);
+        return count_between(0, index) + m_shards[index].tree.rank(key);
+    }
+
+    // number of keys in [begin, end], 0 if end <= begin like BTree::distance.
+    // Only the two end shards are locked and read, on the calling thread
+    size_t distance(const Key &begin, const Key &end) const {
+        if (!(begin < end)) {
+            return 0;
+        }
+        lock_t first_lock;
+        lock_t last_lock;
+        auto [first, last] = lock_ends(begin, end, first_lock, last_lock);
+        if (first == last) {
+            return m_shards[first].tree.distance(begin, end);
+        }
+        return tail_count(first, begin) + count_between(first + 1, last) +
+               head_count(last, end);
+    }
+
+    // out[i] = distance(ranges[i].first, ranges[i].second). Lookups are
+    // grouped by shard and answered by BTree::distance_many of the shard,
+    // shards are handed out to the pool threads, so each thread walks the
+    // memory of its own shards only
+    void distance_many(std::span<const std::pair<Key, Key>> ranges, std::span<size_t> out) const {
+        enum class Part { whole, tail, head };
+        struct Probe {
+            const std::pair<Key, Key> *range;
+            size_t *out;
+            Part part;
+        };
+        // one consistent view for the whole batch
+        std::vector<lock_t> locks;
+        lock_all(locks);
+        std::vector<size_t> prefix(m_shards.size() + 1, 0);
+        for (size_t i = 0; i < m_shards.size(); ++i) {
+            prefix[i + 1] = prefix[i] + m_shards[i].tree.size();
+        }
+        // the two ends of a range write to different slots
+        std::vector<size_t> heads(ranges.size(), 0);
+        std::vector<std::vector<Probe>> probes(m_shards.size());
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            const auto &[begin, end] = ranges[i];
+            out[i] = 0;
+            if (!(begin < end)) {
+                continue;
+            }
+            size_t first = shard_of(begin);
+            size_t last = shard_of(end);
+            if (first == last) {
+                probes[first].push_back({&ranges[i], &out[i], Part::whole});
+            } else {
+                out[i] = prefix[last] - prefix[first + 1];
+                probes[first].push_back({&ranges[i], &out[i], Part::tail});
+                probes[last].push_back({&ranges[i], &heads[i], Part::head});
+            }
+        }
+
+        m_pool.run(m_shards.size(), [&](size_t index) {
+            const tree_t &tree = m_shards[index].tree;
+            if (tree.empty() || probes[index].empty()) {
+                return;
+            }
+            // parts of a range are ranges to the first or last key of the
+            // shard, which distance counts as empty when they are one key
+            const Key &min = *tree.begin();
+            const Key &max = *tree.select(tree.size() - 1);
+            std::vector<std::pair<Key, Key>> local;
+            local.reserve(probes[index].size());
+            for (const Probe &probe : probes[index]) {
+                const auto &[begin, end] = *probe.range;
+                local.emplace_back(probe.part == Part::head ? min : begin,
+                                   probe.part == Part::tail ? max : end);
+            }
+            std::vector<size_t> counts(local.size());
+            tree.distance_many(local, counts);
+            for (size_t i = 0; i < local.size(); ++i) {
+                const auto &[begin, end] = local[i];
+                bool single = probes[index][i].part != Part::whole && !(begin < end) &&
+                              !(end < begin);
+                *probes[index][i].out += counts[i] + single;
+            }
+        });
+
+        for (size_t i = 0; i < ranges.size(); ++i) {
+            out[i] += heads[i];
+        }
+    }
+
+    // Moves bounds so that every shard holds size() / shards() keys, give or
+    // take one, if the largest shard holds more than skew times that.
+    // Returns whether it did. Keys move between neighbours with BTree::split
+    // and BTree::join: a pass to the right sheds the excess of each prefix
+    // of shards, a pass to the left fills up each suffix, O(shards * log n)
+    // in all. All shards stay locked while bounds move, so it may overlap
+    // any other call.
+    bool rebalance(double skew = max_skew) {
+        std::vector<lock_t> locks;
+        lock_all(locks);
+        size_t total = 0;
+        size_t largest = 0;
+        for (const Shard &shard : m_shards) {
+            total += shard.tree.size();
+            largest = std::max(largest, shard.tree.size());
+        }
+        size_t shards = m_shards.size();
+        if (total < shards) {
+            return false;
+        }
+        if (largest <= skew * total / shards) {
+            return false;
+        }
+        begin_move();
+        // keys of shards 0..i should be target(i)
+        auto target = [&](size_t i) { return (i + 1) * total / shards; };
+
+        size_t prefix = 0;
+        for (size_t i = 0; i + 1 < shards; ++i) {
+            size_t count = m_shards[i].tree.size();
+            if (prefix + count > target(i)) {
+                move_tail(i, target(i) - prefix);
+            }
+            prefix += m_shards[i].tree.size();
+        }
+        size_t suffix = 0;
+        for (size_t i = shards - 1; i > 0; --i) {
+            size_t count = m_shards[i].tree.size();
+            if (suffix + count > total - target(i - 1)) {
+                move_head(i - 1, suffix + count - (total - target(i - 1)));
+            }
+            suffix += m_shards[i].tree.size();
+        }
+        for (size_t i = 0; i < shards; ++i) {
+            recount(i);
+        }
+        end_move();
+        return true;
+    }
+};
@@ -1,35 +1,250 @@
 #include "Btree.hpp"
-#include <sstream>
-#include <iostream>
 
-int main() {
-    std::string res;
-    BTree<int, 7> tree;
+#include <charconv>
+#include <cstdio>
+#include <cstring>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// Usage: tree [--binary] [file]
+//
+// Commands come from file or stdin: "k x" inserts x, "q a b" prints the
+// number of keys in [a, b]. Input is read in large chunks or mapped when a
+// file is given, results go through one output buffer. With --binary every
+// command is a byte 'k' or 'q' followed by one or two native int32 values.
+
+namespace {
 
-    std::string input;
-    std::getline(std::cin, input);
-    std::stringstream in(input);
+// window over the input, refilled so that a token never straddles a chunk
+class Input final {
+  public:
+    static constexpr size_t chunk_size = 1 << 20;
+    static constexpr size_t max_token = 64;
 
-    while (!in.eof()) {
-        char key = 0;
-        in >> key;
+  private:
+    int m_fd = STDIN_FILENO;
+    std::vector<char> m_buffer;
+    const char *m_begin = nullptr;
+    const char *m_end = nullptr;
+    bool m_eof = false;
+    void *m_map = nullptr;
+    size_t m_map_size = 0;
+
+  public:
+    Input() : m_buffer(chunk_size) { m_begin = m_end = m_buffer.data(); }
+    Input(const Input &) = delete;
+    Input &operator=(const Input &) = delete;
+
+    ~Input() {
+        if (m_map) {
+            ::munmap(m_map, m_map_size);
+        }
+    }
+
+    // the whole file becomes the window, nothing is copied
+    bool map(const char *path) {
+        int fd = ::open(path, O_RDONLY);
+        if (fd < 0) {
+            return false;
+        }
+        struct stat info;
+        bool ok = ::fstat(fd, &info) == 0;
+        m_eof = true;
+        if (ok && info.st_size > 0) {
+            m_map_size = info.st_size;
+            m_map = ::mmap(nullptr, m_map_size, PROT_READ, MAP_PRIVATE, fd, 0);
+            ok = m_map != MAP_FAILED;
+            if (ok) {
+                ::madvise(m_map, m_map_size, MADV_SEQUENTIAL);
+                m_begin = static_cast<const char *>(m_map);
+                m_end = m_begin + m_map_size;
+            } else {
+                m_map = nullptr;
+            }
+        }
+        ::close(fd);
+        return ok;
+    }
+
+    const char *begin() const { return m_begin; }
+    const char *end() const { return m_end; }
+    size_t size() const { return m_end - m_begin; }
+    void advance(const char *to) { m_begin = to; }
+
+    // makes at least count bytes available unless input ends first
+    size_t fill(size_t count) {
+        while (size() < count && !m_eof) {
+            size_t rest = size();
+            std::memmove(m_buffer.data(), m_begin, rest);
+            m_begin = m_buffer.data();
+            m_end = m_begin + rest;
+            ssize_t got = ::read(m_fd, m_buffer.data() + rest, m_buffer.size() - rest);
+            if (got <= 0) {
+                m_eof = true;
+            } else {
+                m_end += got;
+            }
+        }
+        return size();
+    }
+
+    // skips whitespace, false at the end of input
+    bool skip_spaces() {
+        while (fill(1) != 0) {
+            const char *it = m_begin;
+            while (it != m_end && (*it == ' ' || *it == '\n' || *it == '\t' || *it == '\r')) {
+                ++it;
+            }
+            m_begin = it;
+            if (it != m_end) {
+                return true;
+            }
+        }
+        return false;
+    }
+
+    bool read_int(int &value) {
+        if (!skip_spaces()) {
+            return false;
+        }
+        fill(max_token);
+        auto [next, error] = std::from_chars(m_begin, m_end, value);
+        m_begin = next;
+        return error == std::errc();
+    }
+
+    template <typename T>
+    bool read_raw(T &value) {
+        if (fill(sizeof(T)) < sizeof(T)) {
+            return false;
+        }
+        std::memcpy(&value, m_begin, sizeof(T));
+        m_begin += sizeof(T);
+        return true;
+    }
+};
+
+class Output final {
+  private:
+    static constexpr size_t buffer_size = 1 << 20;
+    static constexpr size_t max_number = 24;
+
+    std::vector<char> m_buffer;
+    size_t m_size = 0;
+
+  public:
+    Output() : m_buffer(buffer_size) {}
+    Output(const Output &) = delete;
+    Output &operator=(const Output &) = delete;
+    ~Output() { flush(); }
+
+    void write(size_t value) {
+        if (m_size + max_number > m_buffer.size()) {
+            flush();
+        }
+        char *end = m_buffer.data() + m_buffer.size();
+        char *it = std::to_chars(m_buffer.data() + m_size, end, value).ptr;
+        *it++ = ' ';
+        m_size = it - m_buffer.data();
+    }
+
+    void write(char symbol) {
+        if (m_size == m_buffer.size()) {
+            flush();
+        }
+        m_buffer[m_size++] = symbol;
+    }
+
+    void flush() {
+        std::fwrite(m_buffer.data(), 1, m_size, stdout);
+        std::fflush(stdout);
+        m_size = 0;
+    }
+};
+
+template <typename Tree>
+int run_text(Input &in, Output &out, Tree &tree) {
+    while (in.skip_spaces()) {
+        char command = *in.begin();
+        in.advance(in.begin() + 1);
 
         int arg1 = 0;
         int arg2 = 0;
-        switch (key) {
+        switch (command) {
+        case 'k':
+            if (!in.read_int(arg1)) {
+                return -1;
+            }
+            tree.insert(arg1);
+            break;
+        case 'q':
+            if (!in.read_int(arg1) || !in.read_int(arg2)) {
+                return -1;
+            }
+            out.write(tree.distance(arg1, arg2));
+            break;
+        default:
+            return -1;
+        }
+    }
+    return 0;
+}
+
+template <typename Tree>
+int run_binary(Input &in, Output &out, Tree &tree) {
+    char command = 0;
+    while (in.read_raw(command)) {
+        int32_t arg1 = 0;
+        int32_t arg2 = 0;
+        switch (command) {
         case 'k':
-            in >> arg1;
+            if (!in.read_raw(arg1)) {
+                return -1;
+            }
             tree.insert(arg1);
             break;
         case 'q':
-            in >> arg1;
-            in >> arg2;
-            std::cout << tree.distance(arg1, arg2) << " ";
+            if (!in.read_raw(arg1) || !in.read_raw(arg2)) {
+                return -1;
+            }
+            out.write(tree.distance(arg1, arg2));
             break;
         default:
             return -1;
         }
     }
-    std::cout << std::endl;
     return 0;
-}
\ No newline at end of file
+}
+
+} // namespace
+
+int main(int argc, char **argv) {
+    bool binary = false;
+    const char *path = nullptr;
+    for (int i = 1; i < argc; ++i) {
+        if (std::strcmp(argv[i], "--binary") == 0) {
+            binary = true;
+        } else if (!path) {
+            path = argv[i];
+        } else {
+            std::fprintf(stderr, "usage: %s [--binary] [file]\n", argv[0]);
+            return -1;
+        }
+    }
+
+    Input in;
+    if (path && !in.map(path)) {
+        std::perror(path);
+        return -1;
+    }
+
+    BTree<int, 7> tree;
+    Output out;
+    int result = binary ? run_binary(in, out, tree) : run_text(in, out, tree);
+    out.write('\n');
+    return result;
+}
@@ -1,5 +1,17 @@
 #include <gtest/gtest.h>
+#include <BPlusTree.hpp>
 #include <Btree.hpp>
+#include <BufferedBTree.hpp>
+#include <ConcurrentBTree.hpp>
+#include <MappedBTree.hpp>
+#include <ShardedBTree.hpp>
+#include <cstring>
+#include <filesystem>
+#include <fstream>
+#include <map>
+#include <string>
+#include <string_view>
+#include <thread>
 
 
 static int range_query(const std::set<int> &set, int begin, int end) {
@@ -54,6 +66,915 @@ TEST(BTree, SetCOmpare) {
 }
 
 
+TEST(BTree, EraseSetCompare) {
+    const int max_load = 600;
+    BTree<int, 3> tree;
+    std::set<int> set;
+
+    for (int i = 0; i < max_load; ++i) {
+        int key = (i * 7919) % max_load;
+        tree.insert(key);
+        set.insert(key);
+    }
+    for (int i = 0; i < max_load; i += 3) {
+        int key = (i * 104729) % max_load;
+        EXPECT_EQ(set.erase(key) == 1, tree.erase(key));
+        EXPECT_FALSE(tree.erase(key));
+    }
+
+    for (int i = 0; i < max_load; i += 7) {
+        for (int j = i + 1; j < max_load; j += 5) {
+            EXPECT_EQ(range_query(set, i, j), tree.distance(i, j));
+        }
+        EXPECT_EQ(set.contains(i), tree.find(i) != tree.end());
+    }
+}
+
+
+TEST(BTree, ClearAndCopy) {
+    BTree<int, 4, HeapAllocator> heap_tree;
+    BTree<int, 4> tree;
+    for (int i = 0; i < 500; ++i) {
+        heap_tree.insert(i);
+        tree.insert(i);
+    }
+
+    BTree<int, 4> copy(tree);
+    tree.clear();
+    EXPECT_EQ(tree.find(10), tree.end());
+    EXPECT_EQ(tree.distance(0, 499), 0);
+    EXPECT_EQ(copy.distance(0, 499), 500);
+
+    for (int i = 0; i < 500; i += 2) {
+        EXPECT_TRUE(copy.erase(i));
+        EXPECT_TRUE(heap_tree.erase(i));
+        EXPECT_TRUE(tree.insert(i));
+    }
+    EXPECT_EQ(copy.distance(0, 499), 250);
+    EXPECT_EQ(heap_tree.distance(0, 499), 250);
+    EXPECT_EQ(tree.distance(0, 499), 250);
+}
+
+
+TEST(BTree, OrderStatistics) {
+    const int max_load = 1000;
+    BTree<int, 4> tree;
+    for (int i = 0; i < max_load; ++i) {
+        tree.insert(3 * ((i * 7919) % max_load));
+    }
+    for (int i = 0; i < max_load; i += 5) {
+        tree.erase(3 * i);
+    }
+    std::vector<int> keys(tree.begin(), tree.end());
+    ASSERT_EQ(keys.size(), tree.size());
+
+    for (size_t k = 0; k < keys.size(); ++k) {
+        EXPECT_EQ(*tree.select(k), keys[k]);
+        EXPECT_EQ(tree.rank(keys[k]), k);
+        EXPECT_EQ(tree.rank(keys[k] + 1), k + 1);
+    }
+    EXPECT_EQ(tree.select(keys.size()), tree.end());
+    EXPECT_EQ(*tree.quantile(0.0), keys.front());
+    EXPECT_EQ(*tree.quantile(1.0), keys.back());
+    EXPECT_EQ(*tree.quantile(0.5), keys[400]);
+}
+
+
+TEST(BTree, BulkLoad) {
+    std::vector<int> keys;
+    for (int i = 0; i < 2000; ++i) {
+        keys.push_back(i / 2 * 3);
+    }
+    std::set<int> set(keys.begin(), keys.end());
+
+    for (double fill : {0.5, 0.75, 1.0}) {
+        BTree<int, 5> tree(keys.begin(), keys.end(), fill);
+        EXPECT_EQ(tree.size(), set.size());
+        EXPECT_TRUE(std::equal(tree.begin(), tree.end(), set.begin(), set.end()));
+
+        for (int i = 0; i < 3000; i += 11) {
+            for (int j = i + 1; j < 3000; j += 97) {
+                EXPECT_EQ(range_query(set, i, j), tree.distance(i, j));
+            }
+        }
+        EXPECT_TRUE(tree.insert(1));
+        EXPECT_TRUE(tree.erase(3));
+        EXPECT_EQ(tree.size(), set.size());
+    }
+}
+
+
+TEST(BTree, Batches) {
+    const int max_load = 3000;
+    BTree<int, 4> tree;
+    std::set<int> set;
+
+    std::vector<int> batch;
+    for (int i = 0; i < max_load; ++i) {
+        batch.push_back((i * 7919) % (max_load / 2));
+    }
+    set.insert(batch.begin(), batch.end());
+    EXPECT_EQ(tree.insert_batch(batch), set.size());
+    EXPECT_EQ(tree.insert_batch(batch), 0);
+    EXPECT_TRUE(std::equal(tree.begin(), tree.end(), set.begin(), set.end()));
+
+    std::vector<std::pair<int, int>> ranges;
+    for (int i = 0; i < max_load; i += 13) {
+        ranges.push_back({(i * 31) % max_load - 10, (i * 17) % max_load});
+    }
+    std::vector<size_t> out(ranges.size());
+    tree.distance_batch(ranges, out);
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        EXPECT_EQ(out[i], tree.distance(ranges[i].first, ranges[i].second));
+    }
+}
+
+TEST(BTree, InterleavedLookups) {
+    const int max_load = 5000;
+    BTree<int, 3> tree;
+    BTreeMultiset<int, 2> multiset;
+    for (int i = 0; i < max_load; ++i) {
+        tree.insert((i * 7919) % (2 * max_load));
+        multiset.insert(i % 701);
+    }
+
+    std::vector<int> keys;
+    std::vector<std::pair<int, int>> ranges;
+    for (int i = 0; i < max_load; i += 7) {
+        keys.push_back((i * 31) % (2 * max_load + 20) - 10);
+        ranges.push_back({(i * 31) % (2 * max_load) - 10, (i * 17) % (2 * max_load)});
+    }
+    std::vector<BTree<int, 3>::const_iterator> found(keys.size());
+    tree.find_many(keys, found);
+    std::vector<size_t> out(ranges.size());
+    tree.distance_many(ranges, out);
+    for (size_t i = 0; i < keys.size(); ++i) {
+        EXPECT_TRUE(found[i] == tree.find(keys[i]));
+        EXPECT_EQ(out[i], tree.distance(ranges[i].first, ranges[i].second));
+    }
+
+    multiset.distance_many(ranges, out);
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        EXPECT_EQ(out[i], multiset.distance(ranges[i].first, ranges[i].second));
+    }
+    BTree<int, 3> empty;
+    empty.find_many(keys, found);
+    EXPECT_TRUE(found[0] == empty.end());
+}
+
+
+TEST(BTree, HintedInsert) {
+    const int max_load = 6000;
+    BTree<int, 3> tree;
+    BTreeMultiset<int, 2> multiset;
+    std::set<int> set;
+    std::multiset<int> occurrences;
+    auto hint = tree.end();
+    for (int i = 0; i < max_load; ++i) {
+        // nearly sorted, with a few keys far behind
+        int key = i % 97 == 0 ? i / 2 : i + i % 5;
+        hint = tree.insert(hint, key);
+        EXPECT_EQ(*hint, key);
+        multiset.insert(key / 4);
+        occurrences.insert(key / 4);
+        set.insert(key);
+        if (i == max_load / 2) {
+            // inserts must not reach nodes the snapshot shares
+            auto snapshot = tree.snapshot();
+            std::set<int> before = set;
+            for (int j = i; j < i + 200; ++j) {
+                tree.insert(j);
+                set.insert(j);
+            }
+            EXPECT_TRUE(std::equal(snapshot.begin(), snapshot.end(), before.begin(), before.end()));
+        }
+    }
+    EXPECT_TRUE(std::equal(tree.begin(), tree.end(), set.begin(), set.end()));
+    for (int i = -1; i < max_load + 10; i += 37) {
+        EXPECT_EQ(tree.distance(i, i + 300), range_query(set, i, i + 300));
+    }
+    EXPECT_TRUE(std::equal(multiset.begin(), multiset.end(), occurrences.begin(),
+                           occurrences.end()));
+}
+
+TEST(BTree, BidirectionalIteration) {
+    BTree<int, 3> tree;
+    std::set<int> set;
+    for (int i = 0; i < 1500; ++i) {
+        int key = (i * 7919) % 3000;
+        tree.insert(key);
+        set.insert(key);
+    }
+    EXPECT_TRUE(std::equal(std::make_reverse_iterator(tree.end()),
+                           std::make_reverse_iterator(tree.begin()), set.rbegin(), set.rend()));
+
+    for (int i = -1; i < 3001; i += 7) {
+        auto [first, last] = tree.equal_range(i);
+        auto [set_first, set_last] = set.equal_range(i);
+        EXPECT_EQ(first == tree.end(), set_first == set.end());
+        EXPECT_EQ(last == tree.end(), set_last == set.end());
+        if (set_first != set.end()) {
+            EXPECT_EQ(*first, *set_first);
+        }
+        if (set_last != set.end()) {
+            EXPECT_EQ(*last, *set_last);
+        }
+        if (set_first != set.begin()) {
+            EXPECT_EQ(*std::prev(first), *std::prev(set_first));
+        }
+    }
+}
+
+
+TEST(BTree, Snapshot) {
+    const int max_load = 5000;
+    BTree<int, 3> tree;
+    std::set<int> set;
+    for (int i = 0; i < max_load; i += 2) {
+        tree.insert(i);
+        set.insert(i);
+    }
+
+    auto snapshot = tree.snapshot();
+    // the snapshot is read on another thread while the tree changes
+    std::thread reader([&snapshot, &set] {
+        for (int i = 0; i < max_load; i += 5) {
+            EXPECT_EQ(snapshot.distance(i, i + 100), range_query(set, i, i + 100));
+            EXPECT_EQ(set.contains(i), snapshot.find(i) != snapshot.end());
+        }
+        EXPECT_TRUE(std::equal(snapshot.begin(), snapshot.end(), set.begin(), set.end()));
+    });
+    for (int i = 0; i < max_load; ++i) {
+        if (i % 2 == 0) {
+            tree.erase(i);
+        } else {
+            tree.insert(i);
+        }
+    }
+    reader.join();
+
+    EXPECT_EQ(snapshot.size(), set.size());
+    EXPECT_EQ(tree.size(), max_load / 2);
+    EXPECT_EQ(*tree.begin(), 1);
+
+    // writing to a snapshot copies shared nodes as well
+    snapshot.insert(-1);
+    EXPECT_EQ(*snapshot.begin(), -1);
+    EXPECT_EQ(*tree.begin(), 1);
+
+    // a snapshot dropped on the reader thread frees the nodes the tree has
+    // copied meanwhile, while the tree keeps allocating
+    std::atomic<bool> copied = false;
+    std::thread dropper([view = tree.snapshot(), size = tree.size(), &copied]() mutable {
+        while (!copied) {
+            std::this_thread::yield();
+        }
+        EXPECT_EQ(view.size(), size);
+        view.clear();
+    });
+    for (int i = 0; i < max_load; ++i) {
+        tree.insert(max_load + i);
+        if (i % 2 == 1) {
+            tree.erase(i);
+        }
+        if (i == max_load / 2) {
+            copied = true;
+        }
+    }
+    dropper.join();
+    EXPECT_EQ(tree.size(), max_load);
+    EXPECT_EQ(*tree.begin(), max_load);
+}
+
+TEST(BTree, SaveAndMap) {
+    auto path = std::filesystem::temp_directory_path() / "btree_test_image";
+    BTree<int64_t, 4> tree;
+    for (int64_t i = 0; i < 3000; ++i) {
+        tree.insert((i * 7919) % 6007);
+    }
+    tree.save(path);
+
+    MappedBTree<int64_t, 4> mapped(path);
+    EXPECT_EQ(mapped.size(), tree.size());
+    EXPECT_TRUE(std::equal(mapped.begin(), mapped.end(), tree.begin(), tree.end()));
+    EXPECT_TRUE(std::equal(std::make_reverse_iterator(mapped.end()),
+                           std::make_reverse_iterator(mapped.begin()),
+                           std::make_reverse_iterator(tree.end()),
+                           std::make_reverse_iterator(tree.begin())));
+    for (int64_t i = -1; i < 6010; i += 13) {
+        EXPECT_EQ(mapped.distance(i, i + 200), tree.distance(i, i + 200));
+        EXPECT_EQ(mapped.find(i) != mapped.end(), tree.find(i) != tree.end());
+        EXPECT_EQ(mapped.rank(i), tree.rank(i));
+    }
+
+    EXPECT_TRUE(mapped.verify());
+
+    // the first son of the root follows it, point it past the image
+    std::vector<char> image(std::filesystem::file_size(path));
+    std::ifstream(path, std::ios::binary).read(image.data(), image.size());
+    const int64_t node_size = sizeof(ImageNode<int64_t, 4>);
+    bool patched = false;
+    for (size_t i = image_page_size; !patched && i + 16 <= image_page_size + node_size; i += 8) {
+        int64_t sons[2];
+        std::memcpy(sons, image.data() + i, sizeof(sons));
+        if (sons[0] == node_size && sons[1] == 2 * node_size) {
+            sons[0] = int64_t{1} << 40;
+            std::memcpy(image.data() + i, sons, sizeof(sons));
+            patched = true;
+        }
+    }
+    ASSERT_TRUE(patched);
+    std::ofstream(path, std::ios::binary).write(image.data(), image.size());
+    EXPECT_FALSE((MappedBTree<int64_t, 4>(path).verify()));
+
+    for (size_t node_size : {64, 192, 4096, 4160, 9000}) {
+        ImageLayout layout{node_size};
+        for (size_t i = 0; i < 100; ++i) {
+            size_t offset = layout.offset(i);
+            EXPECT_GE(offset, i == 0 ? 0 : layout.offset(i - 1) + node_size);
+            EXPECT_EQ(layout.index(offset, 100), i);
+            if (node_size <= image_page_size) {
+                EXPECT_EQ(offset / image_page_size, (offset + node_size - 1) / image_page_size);
+            } else {
+                EXPECT_EQ(offset % image_page_size, 0);
+            }
+        }
+    }
+
+    BTree<int64_t, 4>().save(path);
+    EXPECT_TRUE((MappedBTree<int64_t, 4>(path).empty()));
+    EXPECT_THROW((MappedBTree<int64_t, 5>(path)), std::runtime_error);
+    std::filesystem::remove(path);
+}
+
+TEST(BTree, Stats) {
+    operation_counters().reset();
+    BTree<int, 2> tree;
+    for (int i = 0; i < 1000; ++i) {
+        tree.insert(i);
+    }
+    auto stats = tree.stats();
+    EXPECT_EQ(stats.keys, tree.size());
+    EXPECT_EQ(stats.fill.size(), stats.height);
+    for (double fill : stats.fill) {
+        EXPECT_GT(fill, 0);
+        EXPECT_LE(fill, 1);
+    }
+    EXPECT_EQ(stats.node_bytes, stats.nodes * sizeof(Node<int, 2>));
+    EXPECT_GT(stats.key_bytes + stats.son_bytes, 0);
+    EXPECT_EQ((BTree<int, 2>().stats().height), 0);
+
+    auto counters = operation_counters();
+    if (BTREE_STATS) {
+        // each split adds one node, each new root adds one level
+        EXPECT_EQ(counters.operations, 1000);
+        EXPECT_EQ(counters.splits, stats.nodes - stats.height);
+        EXPECT_GT(counters.nodes_per_operation(), 1);
+        EXPECT_LE(counters.nodes_per_operation(), stats.height);
+
+        for (int i = 0; i < 1000; i += 2) {
+            tree.erase(i);
+        }
+        EXPECT_GT(operation_counters().merges, 0);
+        EXPECT_GT(operation_counters().rotations, 0);
+    } else {
+        EXPECT_EQ(counters.operations, 0);
+    }
+}
+
+// copies are counted to check that inserted keys are only moved
+struct CopyCounted {
+    static inline size_t copies = 0;
+    int value = 0;
+
+    CopyCounted() = default;
+    explicit CopyCounted(int value) : value(value) {}
+    CopyCounted(const CopyCounted &other) : value(other.value) { copies += 1; }
+    CopyCounted(CopyCounted &&) = default;
+    CopyCounted &operator=(const CopyCounted &other) {
+        value = other.value;
+        copies += 1;
+        return *this;
+    }
+    CopyCounted &operator=(CopyCounted &&) = default;
+
+    bool operator<(const CopyCounted &other) const { return value < other.value; }
+};
+
+TEST(BTree, MoveInsert) {
+    BTree<CopyCounted, 2> tree;
+    for (int i = 0; i < 1000; ++i) {
+        tree.insert(CopyCounted((i * 7919) % 1009));
+        tree.emplace(i);
+    }
+    EXPECT_EQ(CopyCounted::copies, 0);
+    EXPECT_EQ(tree.size(), 1009);
+    EXPECT_TRUE(std::is_sorted(tree.begin(), tree.end()));
+}
+
+TEST(BTree, Compare) {
+    BTree<std::string, 4, NodePool, std::less<>> tree;
+    std::set<std::string, std::less<>> set;
+    for (int i = 0; i < 500; ++i) {
+        tree.insert(std::to_string(i));
+        set.insert(std::to_string(i));
+    }
+    std::string_view key = "250";
+    EXPECT_EQ(*tree.find(key), key);
+    EXPECT_EQ(tree.find(std::string_view("x")), tree.end());
+    EXPECT_EQ(tree.rank(key), std::distance(set.begin(), set.lower_bound(key)));
+    EXPECT_EQ(*tree.upper_bound(std::string_view("25")), *set.upper_bound("25"));
+    EXPECT_EQ(tree.distance(std::string_view("1"), std::string_view("2")),
+              std::distance(set.lower_bound("1"), set.upper_bound("2")));
+
+    BTree<int, 3, NodePool, std::greater<>> descending;
+    for (int i = 0; i < 100; ++i) {
+        descending.insert(i);
+    }
+    EXPECT_EQ(*descending.begin(), 99);
+    EXPECT_TRUE(std::is_sorted(descending.begin(), descending.end(), std::greater<>()));
+    EXPECT_EQ(descending.distance(10, 5), 6);
+    EXPECT_EQ(descending.distance(5, 10), 0);
+    for (int i = 0; i < 100; i += 2) {
+        EXPECT_TRUE(descending.erase(i));
+    }
+    EXPECT_EQ(descending.rank(50), 25);
+}
+
+TEST(BTreeMap, MapCompare) {
+    const int max_load = 3000;
+    BTreeMap<int, std::string, 3> tree;
+    std::map<int, std::string> map;
+    for (int i = 0; i < max_load; ++i) {
+        int key = (i * 7919) % 1511;
+        tree[key] += std::to_string(i) + ",";
+        map[key] += std::to_string(i) + ",";
+    }
+    auto [it, inserted] = tree.try_emplace(1, "ignored");
+    EXPECT_FALSE(inserted);
+    EXPECT_EQ(it->second, map[1]);
+    EXPECT_TRUE(tree.try_emplace(-1, 3, 'x').second);
+    map.try_emplace(-1, 3, 'x');
+
+    for (int i = 0; i < max_load; i += 3) {
+        EXPECT_EQ(tree.erase(i), map.erase(i) == 1);
+    }
+    EXPECT_EQ(tree.size(), map.size());
+    EXPECT_TRUE(std::equal(tree.begin(), tree.end(), map.begin(), map.end(),
+                           [](auto lhs, const auto &rhs) {
+                               return lhs.first == rhs.first && lhs.second == rhs.second;
+                           }));
+    EXPECT_EQ(tree.distance(100, 900), std::distance(map.lower_bound(100), map.upper_bound(900)));
+    EXPECT_EQ((*tree.select(10)).second, std::next(map.begin(), 10)->second);
+    EXPECT_EQ(tree.find(3), tree.end());
+
+    // values written after a snapshot stay out of it
+    auto snapshot = tree.snapshot();
+    tree[2] = "changed";
+    EXPECT_EQ(snapshot.find(2)->second, map[2]);
+    EXPECT_EQ(tree.find(2)->second, "changed");
+}
+
+TEST(BTree, Aggregates) {
+    const int max_load = 4000;
+    BTree<int64_t, 3, NodePool, std::less<int64_t>, void, SumAggregate<int64_t>> sums;
+    BTreeMap<int, int, 2, NodePool, std::less<int>, MaxAggregate<int>> maxima;
+    std::map<int, int> map;
+    for (int i = 0; i < max_load; ++i) {
+        int key = (i * 7919) % 2003;
+        sums.insert(key);
+        maxima.insert_or_assign(key, i % 1000);
+        map[key] = i % 1000;
+        if (i % 3 == 0) {
+            sums.erase(i % 2003);
+            maxima.erase(i % 2003);
+            map.erase(i % 2003);
+        }
+    }
+
+    for (int begin = -5; begin < 2010; begin += 37) {
+        for (int end : {begin, begin + 1, begin + 50, begin + 900}) {
+            int64_t sum = 0;
+            int max = std::numeric_limits<int>::lowest();
+            for (auto it = map.lower_bound(begin); it != map.end() && it->first <= end; ++it) {
+                sum += it->first;
+                max = std::max(max, it->second);
+            }
+            EXPECT_EQ(sums.aggregate(begin, end), begin < end ? sum : 0);
+            EXPECT_EQ(maxima.aggregate(begin, end),
+                      begin < end ? max : MaxAggregate<int>::identity());
+        }
+    }
+    EXPECT_EQ(sums.aggregate(), sums.aggregate(-1, 2003));
+
+    BTree<int, 4> counts{1, 2, 3, 5, 8};
+    EXPECT_EQ(counts.aggregate(2, 6), counts.distance(2, 6));
+    EXPECT_EQ(counts.aggregate(), 5);
+}
+
+TEST(BTree, EraseRange) {
+    const int max_load = 5000;
+    BTree<int, 3> tree;
+    std::set<int> set;
+    for (int i = 0; i < max_load; ++i) {
+        int key = (i * 7919) % (2 * max_load);
+        tree.insert(key);
+        set.insert(key);
+    }
+    auto snapshot = tree.snapshot();
+    std::set<int> before = set;
+
+    for (auto [begin, end] : {std::pair{100, 2600}, {-5, 40}, {9000, 20000}, {3000, 3001},
+                              {4000, 3000}, {500, 9200}}) {
+        size_t erased = 0;
+        if (begin < end) {
+            erased = range_query(set, begin, end);
+            set.erase(set.lower_bound(begin), set.upper_bound(end));
+        }
+        EXPECT_EQ(tree.erase_range(begin, end), erased);
+        ASSERT_EQ(tree.size(), set.size());
+        EXPECT_TRUE(std::equal(tree.begin(), tree.end(), set.begin(), set.end()));
+    }
+    // the tree stays balanced for further updates
+    for (int i = 0; i < max_load; i += 3) {
+        EXPECT_EQ(tree.insert(i), set.insert(i).second);
+    }
+    for (int i = -1; i < 2 * max_load; i += 71) {
+        EXPECT_EQ(tree.distance(i, i + 300), range_query(set, i, i + 300));
+    }
+    EXPECT_TRUE(std::equal(snapshot.begin(), snapshot.end(), before.begin(), before.end()));
+}
+
+TEST(BTree, SplitJoin) {
+    const int max_load = 3000;
+    std::vector<int> keys;
+    BTree<int, 2> tree;
+    for (int i = 0; i < max_load; ++i) {
+        keys.push_back(2 * i);
+        tree.insert(2 * i);
+    }
+
+    for (int key : {-1, 0, 1, 1001, 2999, 5998, 7000}) {
+        auto right = tree.split(key);
+        size_t left_size = std::lower_bound(keys.begin(), keys.end(), key) - keys.begin();
+        ASSERT_EQ(tree.size(), left_size);
+        ASSERT_EQ(right.size(), keys.size() - left_size);
+        EXPECT_TRUE(std::equal(tree.begin(), tree.end(), keys.begin(), keys.begin() + left_size));
+        EXPECT_TRUE(std::equal(right.begin(), right.end(), keys.begin() + left_size, keys.end()));
+        EXPECT_EQ(right.rank(4000), std::max<int>(2000 - left_size, 0));
+        tree.join(std::move(right));
+        ASSERT_EQ(tree.size(), keys.size());
+        EXPECT_TRUE(std::equal(tree.begin(), tree.end(), keys.begin(), keys.end()));
+    }
+
+    // trees of different heights and pools
+    BTree<int, 2> small{7000, 7002};
+    BTree<int, 2> large;
+    for (int i = 0; i < max_load; ++i) {
+        large.insert(8000 + i);
+    }
+    small.join(std::move(large));
+    tree.join(std::move(small));
+    EXPECT_EQ(tree.size(), keys.size() + max_load + 2);
+    EXPECT_EQ(tree.distance(5998, 8001), 5);
+    EXPECT_TRUE(std::is_sorted(tree.begin(), tree.end()));
+
+    BTree<int, 2> overlapping{5, 6};
+    EXPECT_THROW(tree.join(std::move(overlapping)), std::invalid_argument);
+}
+
+TEST(FrozenBTree, FrozenCompare) {
+    const int max_load = 20000;
+    BTree<int, 4> tree;
+    BTreeMultiset<int64_t, 3> multiset;
+    for (int i = 0; i < max_load; ++i) {
+        tree.insert((i * 7919) % (3 * max_load));
+        multiset.insert(i % 1009, 1 + i % 3);
+    }
+    auto frozen = tree.freeze();
+    auto frozen_multiset = multiset.freeze();
+    ASSERT_EQ(frozen.size(), tree.size());
+    ASSERT_EQ(frozen_multiset.size(), multiset.size());
+
+    for (int i = -3; i < 3 * max_load + 3; i += 13) {
+        EXPECT_EQ(frozen.rank(i), tree.rank(i));
+        EXPECT_EQ(frozen.distance(i, i + 500), tree.distance(i, i + 500));
+        EXPECT_EQ(frozen.contains(i), tree.find(i) != tree.end());
+        EXPECT_EQ(frozen_multiset.count(i), multiset.count(i));
+        EXPECT_EQ(frozen_multiset.distance(i / 3, i), multiset.distance(i / 3, i));
+    }
+    EXPECT_EQ(*frozen.find(7919), 7919);
+
+    // the frozen copy keeps the keys it was built from
+    tree.erase(7919);
+    EXPECT_TRUE(frozen.contains(7919));
+    EXPECT_TRUE((BTree<int, 2>().freeze().empty()));
+}
+
+TEST(BTreeMultiset, MultisetCompare) {
+    const int max_load = 6000;
+    BTreeMultiset<int, 2> tree;
+    std::multiset<int> set;
+    for (int i = 0; i < max_load; ++i) {
+        int key = (i * 7919) % 211;
+        set.insert(key);
+        EXPECT_EQ(tree.insert(key), set.count(key));
+        if (i % 5 == 0) {
+            key = (i * 104729) % 211;
+            EXPECT_EQ(tree.erase_one(key), set.contains(key));
+            if (set.contains(key)) {
+                set.erase(set.find(key));
+            }
+        }
+        if (i % 97 == 0) {
+            EXPECT_EQ(tree.erase(i % 211), set.erase(i % 211));
+        }
+    }
+    EXPECT_EQ(tree.insert(1000, 500), 500);
+    for (int i = 0; i < 500; ++i) {
+        set.insert(1000);
+    }
+
+    ASSERT_EQ(tree.size(), set.size());
+    EXPECT_TRUE(std::equal(tree.begin(), tree.end(), set.begin(), set.end()));
+    EXPECT_TRUE(std::equal(std::make_reverse_iterator(tree.end()),
+                           std::make_reverse_iterator(tree.begin()), set.rbegin(), set.rend()));
+    for (int i = -1; i < 220; i += 3) {
+        EXPECT_EQ(tree.count(i), set.count(i));
+        EXPECT_EQ(tree.rank(i), std::distance(set.begin(), set.lower_bound(i)));
+        EXPECT_EQ(tree.distance(i, i + 40),
+                  std::distance(set.lower_bound(i), set.upper_bound(i + 40)));
+        EXPECT_EQ(std::distance(tree.lower_bound(i), tree.upper_bound(i)), set.count(i));
+    }
+    for (size_t k = 0; k < set.size(); k += 41) {
+        EXPECT_EQ(*tree.select(k), *std::next(set.begin(), k));
+    }
+
+    // each distinct key is stored once
+    std::set<int> distinct(set.begin(), set.end());
+    EXPECT_EQ(tree.stats().keys, distinct.size());
+}
+
+TEST(BPlusTree, SetCompare) {
+    const int max_load = 2000;
+    BPlusTree<int, 3> tree;
+    std::set<int> set;
+
+    for (int i = 0; i < max_load; ++i) {
+        int key = (i * 7919) % max_load;
+        EXPECT_EQ(set.insert(key).second, tree.insert(key));
+    }
+    for (int i = 0; i < max_load; i += 3) {
+        int key = (i * 104729) % max_load;
+        EXPECT_EQ(set.erase(key) == 1, tree.erase(key));
+    }
+    EXPECT_EQ(tree.size(), set.size());
+    EXPECT_TRUE(std::equal(tree.begin(), tree.end(), set.begin(), set.end()));
+    EXPECT_TRUE(std::equal(std::make_reverse_iterator(tree.end()),
+                           std::make_reverse_iterator(tree.begin()), set.rbegin(), set.rend()));
+
+    for (int i = 0; i < max_load; i += 7) {
+        for (int j = i + 1; j < max_load; j += 53) {
+            EXPECT_EQ(range_query(set, i, j), tree.distance(i, j));
+        }
+        EXPECT_EQ(*tree.lower_bound(i), *set.lower_bound(i));
+        EXPECT_EQ(set.contains(i), tree.find(i) != tree.end());
+    }
+}
+
+TEST(BPlusTree, RangeScan) {
+    BPlusTree<int, 4> tree;
+    for (int i = 0; i < 1000; ++i) {
+        tree.insert(2 * i);
+    }
+    std::vector<int> keys;
+    tree.for_each_in(101, 199, [&](int key) { keys.push_back(key); });
+    ASSERT_EQ(keys.size(), 49);
+    EXPECT_EQ(keys.front(), 102);
+    EXPECT_EQ(keys.back(), 198);
+    EXPECT_EQ(tree.distance(101, 199), keys.size());
+}
+
+TEST(BufferedBTree, BufferedCompare) {
+    const int max_load = 20000;
+    BufferedBTree<int, 2> tree;
+    std::set<int> set;
+
+    // blind writes, some of them leave the set as it is
+    for (int i = 0; i < max_load; ++i) {
+        int key = (i * 7919) % (max_load / 2);
+        if (i % 3 == 2) {
+            set.erase(key);
+            tree.erase(key);
+        } else {
+            set.insert(key);
+            tree.insert(key);
+        }
+        // reads see pending messages without flushing them
+        const auto &view = tree;
+        if (i % 101 == 0) {
+            EXPECT_EQ(view.contains(key), set.contains(key));
+            EXPECT_EQ(view.contains(key + 1), set.contains(key + 1));
+        }
+        if (i % 499 == 0) {
+            EXPECT_TRUE(std::equal(view.begin(), view.end(), set.begin(), set.end()));
+        }
+    }
+
+    std::vector<int> keys;
+    tree.for_each_in(0, max_load, [&](int key) { keys.push_back(key); });
+    EXPECT_TRUE(std::equal(keys.begin(), keys.end(), set.begin(), set.end()));
+    for (int i = -1; i <= max_load / 2; i += 13) {
+        auto it = tree.lower_bound(i);
+        ASSERT_EQ(it == tree.end(), set.lower_bound(i) == set.end());
+        if (it != tree.end()) {
+            EXPECT_EQ(*it, *set.lower_bound(i));
+        }
+        EXPECT_EQ(set.contains(i), tree.find(i) != tree.end());
+    }
+
+    // counts are exact once the wrong deltas are flushed out
+    tree.flush();
+    EXPECT_EQ(tree.size(), set.size());
+    EXPECT_TRUE(std::equal(tree.begin(), tree.end(), set.begin(), set.end()));
+
+    // writes that all change the set keep counts exact without a flush
+    for (int i = 0; i < max_load; ++i) {
+        int key = (i * 104729) % max_load;
+        if (set.erase(key) == 1) {
+            tree.erase(key);
+        } else {
+            set.insert(key);
+            tree.insert(key);
+        }
+        const auto &view = tree;
+        if (i % 101 == 0) {
+            EXPECT_EQ(view.size(), set.size());
+        }
+        if (i % 499 == 0) {
+            EXPECT_EQ(range_query(set, key, key + 500), view.distance(key, key + 500));
+            EXPECT_EQ(std::distance(set.begin(), set.lower_bound(key)), view.rank(key));
+        }
+    }
+    EXPECT_EQ(tree.size(), set.size());
+    EXPECT_TRUE(std::equal(tree.begin(), tree.end(), set.begin(), set.end()));
+}
+
+TEST(ConcurrentBTree, ParallelWriters) {
+    const int threads = 4;
+    const int max_load = 20000;
+    ConcurrentBTree<int, 4> tree;
+
+    // every thread inserts its residue class and erases every third own key,
+    // while reading keys of the other threads
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&tree, t] {
+            for (int i = t; i < max_load; i += threads) {
+                EXPECT_TRUE(tree.insert(i));
+                EXPECT_FALSE(tree.insert(i));
+                tree.contains(max_load - i);
+                tree.distance(i / 2, i);
+            }
+            for (int i = t; i < max_load; i += 3 * threads) {
+                EXPECT_TRUE(tree.erase(i));
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    std::set<int> set;
+    for (int i = 0; i < max_load; ++i) {
+        if (i % (3 * threads) >= threads) {
+            set.insert(i);
+        }
+        EXPECT_EQ(set.contains(i), tree.contains(i));
+    }
+    for (int i = 0; i < max_load; i += 97) {
+        EXPECT_EQ(range_query(set, i, i + 500), tree.distance(i, i + 500));
+    }
+    EXPECT_EQ(tree.distance(-1, max_load), set.size());
+}
+
+
+TEST(ShardedBTree, ShardCompare) {
+    const int max_load = 20000;
+    ShardedBTree<int, 3> tree({5000, 10000, 15000}, 3);
+    std::set<int> set;
+
+    // nearly all keys land in the first shard
+    for (int i = 0; i < max_load; ++i) {
+        int key = i % 7 == 0 ? (i * 7919) % max_load : (i * 104729) % 5000;
+        EXPECT_EQ(set.insert(key).second, tree.insert(key));
+    }
+    for (int i = 0; i < max_load; i += 5) {
+        EXPECT_EQ(set.erase(i) == 1, tree.erase(i));
+    }
+    EXPECT_FALSE(tree.rebalance(100));
+    EXPECT_TRUE(tree.rebalance());
+    EXPECT_EQ(tree.size(), set.size());
+    for (size_t i = 0; i < tree.shards(); ++i) {
+        EXPECT_NEAR(tree.shard(i).size(), set.size() / tree.shards(), 1);
+    }
+
+    std::vector<std::pair<int, int>> ranges;
+    for (int i = -1; i < max_load; i += 97) {
+        ranges.emplace_back(i, i + 3000);
+        EXPECT_EQ(range_query(set, i, i + 3000), tree.distance(i, i + 3000));
+        EXPECT_EQ(std::distance(set.begin(), set.lower_bound(i)), tree.rank(i));
+        EXPECT_EQ(set.contains(i), tree.contains(i));
+    }
+    std::vector<size_t> out(ranges.size());
+    tree.distance_many(ranges, out);
+    for (size_t i = 0; i < ranges.size(); ++i) {
+        EXPECT_EQ(out[i], tree.distance(ranges[i].first, ranges[i].second));
+    }
+}
+
+TEST(ShardedBTree, ParallelShards) {
+    const int threads = 4;
+    const int max_load = 20000;
+    ShardedBTree<int, 4> tree({max_load, 2 * max_load, 3 * max_load});
+
+    // every thread writes keys of its own shard only
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&tree, t] {
+            for (int i = t * max_load; i < (t + 1) * max_load; ++i) {
+                EXPECT_TRUE(tree.insert(i));
+            }
+            for (int i = t * max_load; i < (t + 1) * max_load; i += 3) {
+                EXPECT_TRUE(tree.erase(i));
+            }
+        });
+    }
+    for (auto &worker : workers) {
+        worker.join();
+    }
+
+    EXPECT_EQ(tree.size(), threads * max_load - threads * ((max_load + 2) / 3));
+    for (int i = 0; i < threads * max_load; i += 997) {
+        EXPECT_EQ(tree.contains(i), i % max_load % 3 != 0);
+    }
+}
+
+TEST(ShardedBTree, ConcurrentRebalance) {
+    const int threads = 4;
+    const int max_load = 40000;
+    ShardedBTree<int, 4> tree({1000, 2000, 3000});
+    // negative keys stay put, so reads over them are exact even while
+    // their shards move keys to each other
+    for (int i = -max_load; i < 0; ++i) {
+        EXPECT_TRUE(tree.insert(i));
+    }
+
+    // writers pile keys into the last shard, so shards balance themselves
+    // while another thread rebalances all of them and reads
+    std::vector<std::thread> workers;
+    for (int t = 0; t < threads; ++t) {
+        workers.emplace_back([&tree, t] {
+            for (int i = t; i < max_load; i += threads) {
+                EXPECT_TRUE(tree.insert(i));
+            }
+            for (int i = t; i < max_load; i += 3 * threads) {
+                EXPECT_TRUE(tree.erase(i));
+            }
+        });
+    }
+    std::atomic<bool> done = false;
+    std::thread reader([&] {
+        while (!done) {
+            tree.rebalance(1.0);
+            EXPECT_LE(tree.distance(0, max_load), max_load);
+            EXPECT_EQ(tree.distance(-max_load, -1), max_load);
+            EXPECT_EQ(tree.rank(0), max_load);
+        }
+    });
+    for (auto &worker : workers) {
+        worker.join();
+    }
+    done = true;
+    reader.join();
+
+    std::set<int> set;
+    for (int i = -max_load; i < max_load; ++i) {
+        if (i < 0 || i % (3 * threads) >= threads) {
+            set.insert(i);
+        }
+    }
+    EXPECT_EQ(tree.size(), set.size());
+    for (int i = 0; i < max_load; i += 97) {
+        EXPECT_EQ(range_query(set, i, i + 5000), tree.distance(i, i + 5000));
+        EXPECT_EQ(set.contains(i), tree.contains(i));
+    }
+    tree.rebalance(1.0);
+    for (size_t i = 0; i < tree.shards(); ++i) {
+        EXPECT_NEAR(tree.shard(i).size(), set.size() / tree.shards(), 1);
+    }
+}
+
 int main(int argc, char **argv) {
     ::testing::InitGoogleTest(&argc, argv);
     return RUN_ALL_TESTS();